@@ -0,0 +1,281 @@
+/*-------------bench.cpp------------------------------------------------------//
+*
+*              bench -- timing of the neural net model and netlist generator
+*
+* Purpose: Measure the hot parts of neuralnet.cpp (neurosum, hebbian) and
+*          netlist_gen.cpp (write_netlist) over a range of grid sizes and
+*          spike densities, so changes to either can be checked for speed.
+*
+*   Notes: Both programs are linked in once per grid size (their grid size n
+*          is a compile time constant). Built with -DBIAS_BENCH, each copy
+*          goes into its own namespace and provides the entry points in
+*          bench.h instead of its main.
+*
+*          To compile, use the following commands:
+*              for size in 8 32 128; do
+*                  g++ -c neuralnet.cpp -std=c++11 -O2 -DBIAS_BENCH \
+*                      -DBIAS_N=$size -o net$size.o
+*                  g++ -c netlist_gen.cpp -std=c++11 -O2 -DBIAS_BENCH \
+*                      -DBIAS_N=$size -o gen$size.o
+*              done
+*              g++ bench.cpp net*.o gen*.o -std=c++11 -O2 -pthread \
+*                  -o bench -lz
+*
+*          Run as ./bench [results file]. Every measurement is written as one
+*          JSON object per line to stdout (and to the results file, if
+*          given); a readable table goes to stderr.
+*
+*          Reported:
+*              ns_per_synapse   time of one call divided by n * n
+*              bytes_per_s      netlist bytes out of write_netlist per second
+*                               (build, checks and formatting included)
+*              peak_rss_kb      peak resident size of the measurement
+*
+*          Every measurement runs in a child process of its own, so its
+*          peak resident size is not that of the ones before it. The child
+*          starts as a copy of bench itself, which is included.
+*
+*-----------------------------------------------------------------------------*/
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+using namespace std;
+
+/*----------------------------------------------------------------------------//
+* STRUCTURES AND FUNCTIONS
+*-----------------------------------------------------------------------------*/
+
+// streambuf that only counts what is written to it
+struct counter : streambuf{
+    unsigned long long bytes = 0;
+
+    streamsize xsputn(const char *, streamsize count){
+        bytes += count;
+        return count;
+    }
+
+    int overflow(int c){
+        bytes++;
+        return c;
+    }
+};
+
+// where the results go
+struct sink{
+    ostream *json;
+    ofstream file;
+};
+
+// minimum time spent on every measurement
+const double min_time = 0.2;
+
+// Calls fn until min_time has passed (at least 3 times), seconds per call
+double time_per_call(function<void()> fn);
+
+// Runs fn in a forked child and returns its result; rss is the peak
+// resident set size of the child in kB. NAN and -1 if the child failed.
+double isolated(function<double()> fn, long &rss);
+
+// One JSON line per measurement, to stdout and the results file; value is
+// the parameter as JSON (a number, or a string in quotes)
+void report(sink &out, const string &bench, int size, const string &param,
+            const string &value, const string &metric, double result,
+            long rss);
+
+// neurosum and hebbian for one grid size and spike density
+void bench_net(sink &out, int size, double density, void (*grid)(double),
+               void (*sum)(), void (*learn)());
+
+// write_netlist for one grid size at the given emission level
+void bench_gen(sink &out, int size, int level, int (*write)(ostream &, int));
+
+/*----------------------------------------------------------------------------//
+* MAIN
+*-----------------------------------------------------------------------------*/
+
+int main(int argc, char **argv){
+
+    srand(1);
+
+    sink out;
+    out.json = &cout;
+    if (argc > 1){
+        out.file.open(argv[1]);
+    }
+
+    const double densities[] = {0.05, 0.2, 0.5};
+
+    for (double d : densities){
+        bench_net(out, 8, d, net8::bench_grid, net8::bench_neurosum,
+                  net8::bench_hebbian);
+        bench_net(out, 32, d, net32::bench_grid, net32::bench_neurosum,
+                  net32::bench_hebbian);
+        bench_net(out, 128, d, net128::bench_grid, net128::bench_neurosum,
+                  net128::bench_hebbian);
+    }
+
+    // the levels of netlist_gen.cpp, DETAILED and BEHAVIORAL
+    for (int level : {0, 1}){
+        bench_gen(out, 8, level, gen8::bench_netlist);
+        bench_gen(out, 32, level, gen32::bench_netlist);
+        bench_gen(out, 128, level, gen128::bench_netlist);
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------//
+* SUBROUTINES
+*-----------------------------------------------------------------------------*/
+
+double time_per_call(function<void()> fn){
+
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    int calls = 0;
+
+    while (calls < 3 || elapsed < min_time){
+        fn();
+        calls++;
+        elapsed = chrono::duration<double>(
+                      chrono::steady_clock::now() - start).count();
+    }
+
+    return elapsed / calls;
+}
+
+// The result and the peak come back through a pipe. The child leaves with
+// _exit, so the stream buffers it shares with the parent are not flushed
+// twice.
+double isolated(function<double()> fn, long &rss){
+
+    struct{
+        double result;
+        long rss;
+    } back = {NAN, -1};
+
+    int fd[2];
+    if (pipe(fd) != 0){
+        rss = -1;
+        return NAN;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0){
+        close(fd[0]);
+        back.result = fn();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        back.rss = usage.ru_maxrss;
+        bool sent = write(fd[1], &back, sizeof(back)) == sizeof(back);
+        _exit(sent ? 0 : 1);
+    }
+
+    close(fd[1]);
+    int status = 0;
+    if (pid < 0 || read(fd[0], &back, sizeof(back)) != sizeof(back)){
+        back.result = NAN;
+        back.rss = -1;
+    }
+    close(fd[0]);
+    if (pid > 0){
+        waitpid(pid, &status, 0);
+    }
+
+    rss = back.rss;
+    return back.result;
+}
+
+void report(sink &out, const string &bench, int size, const string &param,
+            const string &value, const string &metric, double result,
+            long rss){
+
+    ostringstream line;
+    line << "{\"bench\": \"" << bench << "\", \"n\": " << size << ", \""
+         << param << "\": " << value << ", \"" << metric << "\": " << result
+         << ", \"peak_rss_kb\": " << rss << "}\n";
+
+    *out.json << line.str() << flush;
+    if (out.file.is_open()){
+        out.file << line.str() << flush;
+    }
+
+    string shown = value;
+    shown.erase(remove(shown.begin(), shown.end(), '"'), shown.end());
+    cerr << setw(14) << left << bench << " n = " << setw(4) << size << ' '
+         << param << " = " << setw(10) << shown << ' ' << metric << " = "
+         << result << '\n';
+}
+
+// The debugging output of the model is silenced while timing. The spike
+// raster from fill_grid is replaced by one of the requested density. Each
+// step gets a child of its own; hebbian needs the postfire raster of one
+// neurosum first.
+void bench_net(sink &out, int size, double density, void (*grid)(double),
+               void (*sum)(), void (*learn)()){
+
+    counter null;
+    streambuf *old = cout.rdbuf(&null);
+
+    long rss_sum, rss_learn;
+    double t_sum = isolated([&](){
+        grid(density);
+        return time_per_call(sum);
+    }, rss_sum);
+    double t_learn = isolated([&](){
+        grid(density);
+        sum();
+        return time_per_call(learn);
+    }, rss_learn);
+
+    cout.rdbuf(old);
+
+    ostringstream value;
+    value << density;
+
+    double synapses = (double)size * size;
+    report(out, "neurosum", size, "density", value.str(), "ns_per_synapse",
+           t_sum * 1e9 / synapses, rss_sum);
+    report(out, "hebbian", size, "density", value.str(), "ns_per_synapse",
+           t_learn * 1e9 / synapses, rss_learn);
+}
+
+// Output is counted instead of stored, so only generation is measured
+void bench_gen(sink &out, int size, int level, int (*write)(ostream &, int)){
+
+    counter null, bytes;
+    streambuf *old_out = cout.rdbuf(&null), *old_err = cerr.rdbuf(&null);
+    ostream deck(&bytes);
+
+    // the bytes of one deck are counted in the child, only the rate
+    // comes back
+    long rss;
+    double rate = isolated([&](){
+        double t = time_per_call([&](){
+            bytes.bytes = 0;
+            write(deck, level);
+        });
+        return bytes.bytes / t;
+    }, rss);
+
+    cout.rdbuf(old_out);
+    cerr.rdbuf(old_err);
+
+    report(out, "write_netlist", size, "level",
+           level ? "\"behavioral\"" : "\"detailed\"", "bytes_per_s",
+           rate, rss);
+}
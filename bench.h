@@ -0,0 +1,40 @@
+/*-------------bench.h--------------------------------------------------------//
+*
+*              bench.h -- what bench.cpp times, per grid size
+*
+* Purpose: neuralnet.cpp and netlist_gen.cpp are compiled once per grid size
+*          with -DBIAS_BENCH -DBIAS_N=<size>. That puts each copy into its
+*          own namespace (net<size>, gen<size>), leaves out its main and
+*          adds the entry points declared here, so bench.cpp links all of
+*          them without seeing their types.
+*
+*-----------------------------------------------------------------------------*/
+
+#ifndef BIAS_BENCH_H
+#define BIAS_BENCH_H
+
+#include <ostream>
+
+// name<size>, the namespace of one copy
+#define BIAS_JOIN(a, b) a##b
+#define BIAS_NAME(a, b) BIAS_JOIN(a, b)
+
+// neuralnet.cpp: bench_grid fills the grid and sets its prefire raster to
+// the given spike density, the other two run one step on it
+// netlist_gen.cpp: write_netlist at the given level into output, returns
+// its exit status
+#define BIAS_BENCH_SIZE(size)                                                 \
+    namespace net##size{                                                      \
+        void bench_grid(double density);                                      \
+        void bench_neurosum();                                                \
+        void bench_hebbian();                                                 \
+    }                                                                         \
+    namespace gen##size{                                                      \
+        int bench_netlist(std::ostream &output, int level);                   \
+    }
+
+BIAS_BENCH_SIZE(8)
+BIAS_BENCH_SIZE(32)
+BIAS_BENCH_SIZE(128)
+
+#endif
@@ -12,7 +12,44 @@
 *          We need to determine the appropriate analog inputs for this file
 *
 *          To compile, use the following command:
-*              g++ netlist_gen.cpp -std=c++11 -o genet
+*              g++ netlist_gen.cpp -std=c++11 -pthread -o genet -lz
+*
+*          Run options:
+*              -b    behavioral mode: multipliers, summing and differential
+*                    amps are written as single ngspice B-sources instead of
+*                    op-amp / diode circuits. Much faster in transient runs;
+*                    leave it off to verify the detailed circuit.
+*              -r    renumber nodes with reverse Cuthill-McKee before writing,
+*                    which keeps the SPICE matrix banded and cuts LU fill-in.
+*                    The matrix bandwidth before and after is reported.
+*              -x    write value fields at a fixed width plus out.net.idx, the
+*                    byte offset of every value field, so the deck can be
+*                    patched in place.
+*              -p <deck> rval=<k> cval=<u> v1=<V>
+*                    patch mode: rewrite only the resistor, capacitor and
+*                    threshold values of a deck written with -x, in place.
+*                    No netlist is generated.
+*              -s <tstop> <dt>
+*                    also run a transient simulation of the core in process
+*                    (seconds, fixed backward Euler step) and write the axon
+*                    voltages to sim.dat. A singular matrix or a step that
+*                    does not converge fails the run like in SPICE: no
+*                    sim.dat and exit status 1. So does a core whose sparse
+*                    LU factors would need more than lu_limit entries.
+*              -t    check the -s solver on a small circuit with values known
+*                    by hand (RC, diode, amp, B-sources), on its RC alone
+*                    (linear, so factored once) and on a singular one, and
+*                    exit; non-zero status if a check fails
+*              -P    partition mode: cut the core at the axons into one deck
+*                    per hillock row (out_p<row>.net) with port sources and
+*                    loads, and describe the ports in out.manifest instead
+*                    of writing out.net. Ports driven from more than one
+*                    row are listed as errors and no decks are written.
+*              -z    write out.net.gz instead of out.net, gzip compressed in
+*                    parallel blocks on background threads. With -x the index
+*                    (out.net.idx) holds uncompressed offsets, and -p also
+*                    takes the .gz deck. With -P the partition decks are
+*                    compressed (out_p<row>.net.gz).
 *
 *  PEMDAS: We will place everything on a grid. The components we need are:
 *              1. inverting amp
@@ -22,6 +59,15 @@
 *
 *          The grid will then be enumerated appropriately by filling the grid
 *              points with integers and counting.
+*
+*          Components are collected in a small circuit IR (struct circuit),
+*              which is checked for floating, single-connection and
+*              duplicate nodes / elements before anything is written.
+*
+*          Junctions and neurons are built once as relative-node blueprints
+*              and stamped into the circuit with a node offset per copy.
+*              Their cards are formatted once too; a copy is written by
+*              filling in its node numbers and element names.
 * 
 *          Finally, this will be written out to a file. 
 *
@@ -33,6 +79,24 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <memory>
+#include <zlib.h>
 
 using namespace std;
 
@@ -49,8 +113,18 @@ std::string to_string_with_precision(const T a_value, const int p)
     return out.str();
 }
 
-//Grid Size
-const int n = 5, p = 4;
+//Grid Size, can be set at compile time (-DBIAS_N=...) as bench.cpp does
+#ifndef BIAS_N
+#define BIAS_N 5
+#endif
+
+// bench.cpp links a copy per grid size, each in namespace gen<BIAS_N>
+#ifdef BIAS_BENCH
+#include "bench.h"
+namespace BIAS_NAME(gen, BIAS_N){
+#endif
+
+const int n = BIAS_N, p = 4;
 
 struct resistor{
 
@@ -81,18 +155,217 @@ struct opamp{
     int inp, inn, out; 
 };
 
+// element kinds in the circuit IR
+// BSUM, BDIF and BMUL are behavioral sources (ngspice B elements)
+enum kind {RES, CAP, DIO, VCVS, VDC, BSUM, BDIF, BMUL};
+
+// behavioral source, output to ground; op is BSUM, BDIF or BMUL
+struct bsource{
+    int op;
+    int forw;
+    vector<int> in;
+};
+
+// emission level for the amplifier / multiplier blocks
+enum level {DETAILED, BEHAVIORAL};
+
+struct blueprint;
+
+// a block stamped from a blueprint, starting at element first
+struct stamped{
+    int first;
+    shared_ptr<const blueprint> bp;
+};
+
+// Structure-of-arrays circuit. Element i has kind[i], value[i] and the nodes
+// node[off[i]] ... node[off[i+1] - 1]; node is the arena every element's
+// terminals are allocated from. Values are in the units written on the card
+// (k for RES and VCVS, u for CAP, V for VDC, plain gain for the B-sources).
+// Nodes are stored in SPICE card order:
+//     RES, CAP, DIO:  back, forw
+//     VCVS:           out, inp, inn        (out- is always ground)
+//     VDC:            forw                 (referenced to ground)
+//     BSUM:           out, in_1 ... in_k   out = -value * sum(v(in))
+//     BDIF:           out, inp, inn        out = value * (v(inp) - v(inn))
+//     BMUL:           out, in1, in2        out = value * v(in1) * v(in2)
+// copies lists the blocks stamped from a blueprint in element order, so emit
+// can write them from its card text; it is empty for circuits built element
+// by element.
+struct circuit{
+    vector<char> kind;
+    vector<double> value;
+    vector<int> off;
+    vector<int> node;
+    vector<stamped> copies;
+};
+
 // struct to pass output and index between functions
+// cir is shared, so copying the netlist around stays cheap
 struct netlist{
-    string str;
+    circuit *cir;
     int index;
-    int rcount, ccount, dcount, ocount;
+    int level;
+};
+
+// counts from the structural checks
+struct report{
+    int floating, single, duplicate;
+};
+
+// what a hole in the card text of a blueprint takes, see cards
+enum hole_type {NODE, COUNT, VALUE};
+
+// one hole, at byte at of the card text
+struct hole{
+    int at, type, arg;
+};
+
+// Card text of a block at one field width, formatted once. What changes
+// between copies is left out of text and marked by a hole: node entry arg
+// of the copy (NODE), the next number of element letter arg (COUNT, letters
+// r c d e v b), or the start of the value field of element arg of the copy
+// (VALUE, for the index).
+struct cards{
+    string text;
+    vector<hole> holes;
+};
+
+// Relative-node template of a block, see make_blueprint. Node entry k of a
+// stamped copy is rel[k] + par[src[k]]; par[0] is always 0, so src 0 marks
+// absolute nodes (ground, threshold...). advance is the net.index step.
+// plain and fixed are the card text of the block for emit at width 0 and at
+// field_width.
+struct blueprint{
+    circuit cir;
+    vector<int> rel, src;
+    int advance;
+    bool ok;
+    cards plain, fixed;
+};
+
+// builds one block into the given circuit from its node parameters
+// par[1...] and returns how far it moved net.index
+typedef function<int(circuit &, const vector<int> &)> block_fn;
+
+// which sweep parameter a value field follows
+enum role {FIXED, RVAL, CVAL, THRESH, ROLES};
+
+// value field of one element in a written deck
+struct field{
+    unsigned long long pos;
+    int elem, role;
+};
+
+// width of the value fields when a deck is written with an index
+const int field_width = 12;
+
+// diode model mod1 is the SPICE default: Is = 1e-14 A, n = 1, at 300 K
+const double diode_is = 1e-14, diode_vt = 0.025852;
+
+// Sparse MNA system of one circuit, see build_mna. Indices are matrix
+// positions after ordering, -1 for ground or unused numbers:
+//     vpos[node], bpos[elem]:  unknown of a node voltage / branch current
+//     kcl[node], beq[elem]:    row of a node's KCL / element's branch equation
+// L and U have the symmetric pattern of the symbolic factorization: column j
+// of L has the rows row[colp[j]] ... row[colp[j+1] - 1] (ascending), row j of
+// U the same columns. lu holds the diagonal of U at lu[i], then L by columns
+// and U by rows in pattern order, so every entry has a fixed slot; slots[k]
+// is the slot of the k-th add() of stamp_mna, next counts them.
+// entries is the size of the factors; over lu_limit build_mna stops before
+// allocating them and lu stays empty.
+// held: the factors of a linear circuit are kept and stamp_mna only builds
+// the right hand side.
+// singular is the position of the first pivot that vanished, -1 if none.
+struct mna{
+    int size, singular;
+    vector<int> vpos, bpos, kcl, beq;
+    vector<char> volt;
+    vector<size_t> colp, slots;
+    vector<int> row;
+    size_t entries, next;
+    bool held;
+    vector<double> lu, rhs;
+    vector<pair<int, int>> *pattern;
+};
+
+// most LU entries (8 bytes of value, 4 of row index each) a simulation may
+// allocate
+const size_t lu_limit = (size_t)1 << 25;
+
+// transient run: settings, probed node waveforms (probes.size() values per
+// time point) and run statistics. error is empty for a valid run, otherwise
+// it says why the run stopped (singular matrix, no convergence), where SPICE
+// would have stopped too; the waveforms are then not a result.
+struct transient{
+    double tstop, dt;
+    vector<int> probes;
+    vector<double> time, wave;
+    string error;
+    int steps, newton, factors, unknowns;
+    size_t entries;
+    double ms;
+};
+
+// run options, filled from the command line in main
+// index is the path of the value index, empty to write a plain deck
+// tstop > 0 runs a transient simulation of the core
+// parts writes partition decks and a manifest instead of a single deck
+// gzip compresses the deck (see gzbuf)
+struct options{
+    bool rcm, parts, gzip;
+    string index;
+    double tstop, dt;
+};
+
+// size of the blocks a compressed deck is cut into
+const size_t block_size = 1 << 20;
+
+// one block of a compressed deck, on its way from the generator to the file
+struct gzblock{
+    string in, out;
+    bool taken, done;
+};
+
+// Output buffer that writes gzip: full blocks are compressed on worker
+// threads, each as its own gzip member (concatenated members are a valid
+// gzip file, zcat and gzread read them as one), and written in order by a
+// writer thread, so the generator only formats. tellp() gives the
+// uncompressed size. A zlib or write error sets failed, after which blocks
+// are dropped; close() returns false then.
+struct gzbuf : streambuf{
+    ostream &out;
+    int level;
+    unsigned long long total;
+    bool done, failed;
+    shared_ptr<gzblock> current;
+    deque<shared_ptr<gzblock>> jobs;
+    mutex lock;
+    condition_variable ready, finished, full;
+    vector<thread> pool;
+    thread writer;
+
+    gzbuf(ostream &output, int level);
+    ~gzbuf();
+    bool close();
+
+    int overflow(int c);
+    pos_type seekoff(off_type off, ios_base::seekdir dir,
+                     ios_base::openmode which);
+
+    void submit();
+    void fresh();
+    void compress();
+    void write();
 };
 
 // struct to hold the connection data in junctions
 // synapse[i][j1...jn] is the vector of ints for summing amp
 // We can connect everything up to the axon[n]. Just re-use those values
+// row[i] is the first circuit element of hillock row i (its junctions and
+// neuron), row[n] is the end of the last row
 struct connectome{
     int axon[n], synapse[n][n], hillock[n];
+    int row[n + 1];
 };
 
 // struct to pass connectome and netlist from functions
@@ -109,38 +382,231 @@ netlist diff_amp(netlist net, resistor inrp, resistor inrn);
 netlist samhold(netlist net, double cval);
 netlist multiplier(netlist net, int in1, int in2, double rval);
 
-// These functions append the appropriate variables to the netlist string
+// These functions append the appropriate elements to the circuit
+void add_elem(circuit &cir, int k, double value, const int *nodes, int count);
 netlist wres(netlist net, resistor r);
 netlist wcap(netlist net, capacitor c);
 netlist wop(netlist net, opamp oa);
 netlist wdi(netlist net, diode d);
+netlist wvol(netlist net, voltage v);
+netlist wbeh(netlist net, bsource b);
 
 // These functions will take care of connections and such within the core
 connet neuron(connet all, voltage thresh, double rval, double cval, int hill);
 connet junction(connet all, int axn, int hill, double rval, double cval);
 
+// Builds a block once per parameter to find which parameter each node
+// follows; delta[k] is the probe step for par[k], it has to keep par[k] valid
+blueprint make_blueprint(block_fn build, const vector<int> &delta);
+
+// Appends a copy of the blueprint for the parameters par
+void stamp(circuit &cir, const shared_ptr<const blueprint> &bp,
+           const vector<int> &par);
+
+// Builds the connectome and all components of a core into net.cir
+connet build_core(netlist net, double rval, double cval);
+
+// Structural checks on the circuit, problems are listed on log
+report validate(const circuit &cir, ostream &log);
+
+// Node adjacency of the circuit (ground left out) in compressed rows
+void adjacency(const circuit &cir, vector<int> &start, vector<int> &adj);
+
+// Largest node distance |i - j| between connected nodes
+int bandwidth(const circuit &cir);
+
+// Reverse Cuthill-McKee order of the used vertices of a graph given in
+// compressed rows
+vector<int> rcm_order(const vector<int> &start, const vector<int> &adj,
+                      const vector<char> &used);
+
+// Minimum degree order of a graph given in compressed rows; fill is the size
+// of the strict lower factor, ordering stops early once it passes limit
+vector<int> min_degree(const vector<int> &start, const vector<int> &adj,
+                       size_t limit, size_t &fill);
+
+// Reverse Cuthill-McKee renumbering of the circuit nodes, returns the
+// old -> new node map (-1 for unused numbers, ground stays 0)
+vector<int> renumber(circuit &cir);
+
+// Writes the card of element i, see the definition
+template <typename Put>
+void card(string &buf, const circuit &cir, size_t i, int width, Put put);
+
+// Formats the card text of all elements of cir at the given width
+void format_cards(cards &cd, const circuit &cir, int width);
+
+// Writes v >= 0 in decimal at out, returns the end
+char *put_int(char *out, int v);
+
+// Writes the circuit as a SPICE deck, see the definition for width / index
+void emit(const circuit &cir, ostream &output, int width,
+          vector<field> *index);
+
+// Writes / reads the value index that goes next to a fixed width deck
+bool write_index(const string &path, const vector<field> &index, int width,
+                 unsigned long long size);
+bool read_index(const string &path, vector<field> &index, int &width,
+                unsigned long long &size);
+
+// Rewrites the values of the given roles in place, value[role] is the new
+// value and set[role] tells whether that role is patched
+int patch_netlist(const string &path, const double *value, const bool *set);
+int patch_fields(char *deck, unsigned long long size,
+                 const vector<field> &index, int width, const double *value,
+                 const bool *set);
+
+// Reads a whole deck, compressed or not
+bool read_deck(const string &path, string &deck);
+
+// Sets up the MNA unknowns, ordering and symbolic LU of a circuit
+mna build_mna(const circuit &cir);
+
+// Stamps the circuit for the Newton iterate x, returns true if a diode
+// step was limited
+bool stamp_mna(mna &m, const circuit &cir, const vector<double> &x,
+               const vector<double> &xold, double dt, vector<double> &vd);
+
+// LU factorization in place (false if the matrix is singular) and the
+// solve that overwrites rhs
+bool factor_mna(mna &m);
+void solve_mna(mna &m);
+
+// Node or branch of the unknown at matrix position i, for messages
+string unknown_name(const mna &m, int i);
+
+// Transient simulation of one circuit
+void simulate(const circuit &cir, transient &tr);
+
+// Runs the solver on a circuit with known results, returns the failures
+int check_solver();
+
+// Writes one deck per hillock row, named <prefix>_p<row>.net (.net.gz
+// with gzip), and the manifest of the ports between them; returns 1 if
+// ports are driven from more than one partition (then no decks are
+// written) or a deck could not be written
+int write_partitions(const circuit &cir, const connectome &grid,
+                     ostream &manifest, const string &prefix, bool gzip);
+
 // This will generate connectome and write final netlist to file
-void write_netlist(netlist net, ofstream &output, double rval, double cval);
+// (or the partition manifest, with opt.parts). Returns the exit status: 1
+// if a simulation with -s failed.
+int write_netlist(netlist net, ostream &output, double rval, double cval,
+                  options opt);
 
 /*----------------------------------------------------------------------------//
 * MAIN
 *-----------------------------------------------------------------------------*/
 
-int main(void){
+// bench.cpp brings its own main and times this instead, see bench.h
+#ifdef BIAS_BENCH
+int bench_netlist(ostream &output, int level){
+
+    circuit cir;
+    netlist net = {};
+    net.cir = &cir;
+    net.level = level;
+    options opt = {};
+
+    return write_netlist(net, output, 1000, 1000, opt);
+}
+#else
+int main(int argc, char **argv){
 
     // creating all the necessary parameters
     double rval = 1000, cval = 1000;
 
-    std::ofstream output("out.net", std::ofstream::out);
-
+    circuit cir;
     netlist net = {};
+    net.cir = &cir;
+    options opt = {};
+
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "-b"){
+            net.level = BEHAVIORAL;
+        }
+        else if (arg == "-r"){
+            opt.rcm = true;
+        }
+        else if (arg == "-x"){
+            opt.index = "out.net.idx";
+        }
+        else if (arg == "-s" && i + 2 < argc){
+            opt.tstop = atof(argv[++i]);
+            opt.dt = atof(argv[++i]);
+            if (opt.tstop <= 0 || opt.dt <= 0){
+                cerr << "-s needs a positive stop time and step\n";
+                return 1;
+            }
+        }
+        else if (arg == "-P"){
+            opt.parts = true;
+        }
+        else if (arg == "-t"){
+            return check_solver() ? 1 : 0;
+        }
+        else if (arg == "-z"){
+            opt.gzip = true;
+        }
+        else if (arg == "-p" && i + 1 < argc){
+            const char *keys[ROLES] = {"", "rval=", "cval=", "v1="};
+            double value[ROLES] = {};
+            bool set[ROLES] = {};
+            string deck = argv[++i];
+
+            for (i++; i < argc; i++){
+                arg = argv[i];
+                int r = RVAL;
+                while (r < ROLES && arg.compare(0, strlen(keys[r]), keys[r])){
+                    r++;
+                }
+                if (r == ROLES){
+                    cerr << "unknown patch value " << arg << '\n';
+                    return 1;
+                }
+                value[r] = atof(arg.c_str() + strlen(keys[r]));
+                set[r] = true;
+            }
+
+            return patch_netlist(deck, value, set);
+        }
+        else{
+            cerr << "unknown option " << arg << '\n';
+            return 1;
+        }
+    }
+
+    if (opt.gzip && !opt.parts){
+        std::ofstream file("out.net.gz", std::ofstream::binary);
+        gzbuf zip(file, Z_DEFAULT_COMPRESSION);
+        ostream output(&zip);
+
+        int status = write_netlist(net, output, rval, cval, opt);
 
-    write_netlist(net, output, rval, cval);
+        bool ok = zip.close();
+        file.close();
+        if (!ok || !file){
+            cerr << "could not write out.net.gz\n";
+            status = 1;
+        }
+        return status;
+    }
+
+    string name = opt.parts ? "out.manifest" : "out.net";
+    std::ofstream output(name, std::ofstream::out);
+
+    int status = write_netlist(net, output, rval, cval, opt);
 
     output.close();
+    if (!output){
+        cerr << "could not write " << name << '\n';
+        status = 1;
+    }
 
-    return 0;
+    return status;
 }
+#endif
 
 /*----------------------------------------------------------------------------//
 * SUBROUTINES
@@ -193,6 +659,21 @@ netlist sum_amp(netlist net, vector<resistor> connections){
     // For this function, it is assumed that all the incoming resistors are
     // of the same value
 
+    // Behavioral: out = -sum(v_in), nothing but the output node is used
+    if (net.level == BEHAVIORAL){
+        bsource bs;
+        bs.op = BSUM;
+        bs.forw = net.index + 1;
+        for (auto &r : connections){
+            bs.in.push_back(r.back);
+        }
+
+        net = wbeh(net, bs);
+        net.index++;
+
+        return net;
+    }
+
     for (auto &r : connections){
         r.forw = net.index;
         net = wres(net, r);
@@ -231,6 +712,19 @@ netlist diff_amp(netlist net, resistor inrp, resistor inrn){
     opamp oa;
     // Note: No resistor def necessary since all resistor values are the same
 
+    // Behavioral: out = v+ - v-, on the same output node as the op-amp
+    if (net.level == BEHAVIORAL){
+        bsource bs;
+        bs.op = BDIF;
+        bs.forw = net.index + 2;
+        bs.in = {inrp.back, inrn.back};
+
+        net = wbeh(net, bs);
+        net.index += 2;
+
+        return net;
+    }
+
     // First, let's write out the resistors we have coming in
     inrp.forw = net.index + 1;
     inrn.forw = net.index;
@@ -307,6 +801,20 @@ netlist multiplier(netlist net, int v1, int v2, double rval){
     diode d1, d2, d3;
     resistor r1, r2, r3, r4, r5, r6, r7, r8, r9, r10;
 
+    // Behavioral: the ideal product, placed on net.index after the call,
+    // which is the node the callers read the result from
+    if (net.level == BEHAVIORAL){
+        bsource bs;
+        bs.op = BMUL;
+        bs.forw = net.index + 7;
+        bs.in = {v1, v2};
+
+        net = wbeh(net, bs);
+        net.index += 7;
+
+        return net;
+    }
+
     // resistor 1
     r1.back = v1;
     r1.forw = v1+1;
@@ -427,30 +935,35 @@ netlist multiplier(netlist net, int v1, int v2, double rval){
     return net;
 }
 
+// Every element is appended to the end of the arena
+void add_elem(circuit &cir, int k, double value, const int *nodes, int count){
+
+    if (cir.off.empty()){
+        cir.off.push_back(0);
+    }
+
+    cir.kind.push_back(k);
+    cir.value.push_back(value);
+    cir.node.insert(cir.node.end(), nodes, nodes + count);
+    cir.off.push_back(cir.node.size());
+}
+
 // Now for just a connecting wire
 // technically a resistor with an incredibly small resistor value... 
 // we are technically trying 0 first...
 // I DON'T KNOW IF 0 WORKS FOR RESISTORS!
 netlist wres(netlist net, resistor r){
 
-    net.str.append("r" + to_string_with_precision(net.rcount, p) + " " 
-                  + to_string_with_precision(r.back, p)+ " "
-                  + to_string_with_precision(r.forw, p) + " " 
-                  + to_string_with_precision(r.value, p) + "k" + "\n");
-
-    net.rcount++;
+    int nodes[2] = {r.back, r.forw};
+    add_elem(*net.cir, RES, r.value, nodes, 2);
 
     return net;
 }
 
 netlist wcap(netlist net, capacitor c){
 
-    net.str.append("c" + to_string_with_precision(net.ccount, p) + " " 
-                  + to_string_with_precision(c.back, p) +  " "
-                  + to_string_with_precision(c.forw, p) + " " 
-                  + to_string_with_precision(c.value, p) + "u" + "\n");
-
-    net.ccount++;
+    int nodes[2] = {c.back, c.forw};
+    add_elem(*net.cir, CAP, c.value, nodes, 2);
 
     return net;
 }
@@ -458,22 +971,33 @@ netlist wcap(netlist net, capacitor c){
 // opamps are defined by their negative input
 netlist wop(netlist net, opamp oa){
 
-    net.str.append("e"+to_string_with_precision(net.ocount, p) + " "
-                  + to_string_with_precision(oa.out, p) + " 0 "
-                  + to_string_with_precision(oa.inp, p) + " " 
-                  + to_string_with_precision(oa.inn, p) + " 999k" + "\n");
-
-    net.ocount++;
+    int nodes[3] = {oa.out, oa.inp, oa.inn};
+    add_elem(*net.cir, VCVS, 999, nodes, 3);
 
     return net;
 }
 
 netlist wdi(netlist net, diode d){
 
-    net.str.append("d" + to_string(net.dcount) + " " + to_string(d.back) + 
-                  + " " + to_string(d.forw) + " mod1" + "\n");
+    int nodes[2] = {d.back, d.forw};
+    add_elem(*net.cir, DIO, 0, nodes, 2);
+
+    return net;
+}
+
+netlist wvol(netlist net, voltage v){
+
+    add_elem(*net.cir, VDC, v.value, &v.forw, 1);
 
-    net.dcount++;
+    return net;
+}
+
+// behavioral sources are referenced to ground
+netlist wbeh(netlist net, bsource b){
+
+    vector<int> nodes(1, b.forw);
+    nodes.insert(nodes.end(), b.in.begin(), b.in.end());
+    add_elem(*net.cir, b.op, 1, nodes.data(), nodes.size());
 
     return net;
 }
@@ -511,8 +1035,10 @@ connet neuron(connet all, voltage thresh, double rval, double cval, int hill){
 
     // DR2
     dr2.back = net.index;
-    dr2.back = net.index + 1;
+    dr2.forw = net.index + 1;
     dr2.value = rval;
+
+    net.index++;
     
     net = diff_amp(net, dr1, dr2); 
 
@@ -536,7 +1062,7 @@ connet neuron(connet all, voltage thresh, double rval, double cval, int hill){
     sr1.value = rval;
 
     // SR2
-    sr2.back = net.index;
+    sr2.forw = net.index;
     sr2.back = net.index + 4;
     sr2.value = rval;
 
@@ -615,7 +1141,6 @@ connet junction(connet all, int axn, int hill, double rval, double cval){
     net = multiplier(net, grid.axon[axn], net.index, rval);
 
     grid.synapse[hill][axn] = net.index;
-    cout << grid.synapse[hill][axn] << '\n';
 
     all.nl = net;
     all.conn = grid;
@@ -623,15 +1148,90 @@ connet junction(connet all, int axn, int hill, double rval, double cval){
 }
 
 
-// This will generate connectome and write fial netlist to file
-void write_netlist(netlist net, ofstream &output, double rval, double cval){
+// A probe builds the block with every parameter at 0 and then with one
+// parameter moved by its delta. A node that moves by exactly that delta in
+// exactly one probe follows that parameter; a node that never moves is
+// absolute. Anything else means the block is not a plain node offset and
+// ok is left false so the caller builds it directly.
+blueprint make_blueprint(block_fn build, const vector<int> &delta){
+
+    blueprint bp;
+    bp.ok = false;
+
+    vector<int> par(delta.size(), 0);
+    bp.advance = build(bp.cir, par);
+    bp.rel = bp.cir.node;
+    bp.src.assign(bp.rel.size(), 0);
+
+    for (size_t k = 1; k < delta.size(); k++){
+        circuit probe;
+        par.assign(delta.size(), 0);
+        par[k] = delta[k];
+
+        if (build(probe, par) != bp.advance ||
+            probe.kind != bp.cir.kind || probe.off != bp.cir.off ||
+            probe.value != bp.cir.value){
+            return bp;
+        }
+
+        for (size_t e = 0; e < bp.rel.size(); e++){
+            int moved = probe.node[e] - bp.rel[e];
+            if (moved == 0){
+                continue;
+            }
+            if (moved != delta[k] || bp.src[e] != 0){
+                return bp;
+            }
+            bp.src[e] = k;
+        }
+    }
+
+    format_cards(bp.plain, bp.cir, 0);
+    format_cards(bp.fixed, bp.cir, field_width);
+
+    bp.ok = true;
+    return bp;
+}
+
+// One pass over the blueprint arrays; the node loop is a gather and an add
+void stamp(circuit &cir, const shared_ptr<const blueprint> &print,
+           const vector<int> &par){
+
+    if (cir.off.empty()){
+        cir.off.push_back(0);
+    }
+
+    const blueprint &bp = *print;
+    int base = cir.node.size();
+    size_t count = bp.rel.size();
+
+    stamped copy = {(int)cir.kind.size(), print};
+    cir.copies.push_back(copy);
+
+    cir.kind.insert(cir.kind.end(), bp.cir.kind.begin(), bp.cir.kind.end());
+    cir.value.insert(cir.value.end(), bp.cir.value.begin(),
+                     bp.cir.value.end());
+
+    for (size_t e = 1; e < bp.cir.off.size(); e++){
+        cir.off.push_back(bp.cir.off[e] + base);
+    }
+
+    cir.node.resize(base + count);
+    int *out = &cir.node[base];
+    const int *rel = bp.rel.data(), *src = bp.src.data(), *pv = par.data();
+    for (size_t e = 0; e < count; e++){
+        out[e] = rel[e] + pv[src[e]];
+    }
+}
+
+// Builds the connectome and all components of a core into net.cir
+// Junctions and neurons are stamped from blueprints; if a blueprint cannot
+// be made, the blocks are built one by one as before.
+connet build_core(netlist net, double rval, double cval){
 
     // generate connectome
     connet all;
     all.nl = net;
-    connectome grid = all.conn;
-
-    all.nl.str.append("BIAS Circuit \n");
 
     // starting with determining the numbers for hillocks and axons
     for (int i = 0; i < n; i++){
@@ -647,27 +1247,1983 @@ void write_netlist(netlist net, ofstream &output, double rval, double cval){
     thresh.forw = 1;
     thresh.value = 10;
 
+    // junction parameters: index, axon node, hill
+    // hill is also an array index in junction, so it is probed by 1
+    const int big = 1 << 20;
+    block_fn jfn = [&](circuit &cir, const vector<int> &par){
+        connet blk = {};
+        blk.nl = net;
+        blk.nl.cir = &cir;
+        blk.nl.index = par[1];
+        blk.conn.axon[0] = par[2];
+        blk = junction(blk, 0, par[3], rval, cval);
+        return blk.nl.index - par[1];
+    };
+
+    // neuron parameters: index, axon node, synapse nodes of the hillock
+    block_fn nfn = [&](circuit &cir, const vector<int> &par){
+        connet blk = {};
+        blk.nl = net;
+        blk.nl.cir = &cir;
+        blk.nl.index = par[1];
+        blk.conn.axon[0] = par[2];
+        for (int i = 0; i < n; i++){
+            blk.conn.synapse[0][i] = par[3 + i];
+        }
+        blk = neuron(blk, thresh, rval, cval, 0);
+        return blk.nl.index - par[1];
+    };
+
+    auto jprint = make_shared<const blueprint>(
+                      make_blueprint(jfn, {0, big, big, 1}));
+    auto nprint = make_shared<const blueprint>(
+                      make_blueprint(nfn, vector<int>(n + 3, big)));
+    const blueprint &jbp = *jprint, &nbp = *nprint;
+
+    if (!jbp.ok || !nbp.ok){
+        cerr << "blueprint failed, building blocks directly\n";
+    }
+
+    // the whole core is known up front, so allocate it once
+    circuit &cir = *all.nl.cir;
+    size_t elems = n * (n * jbp.cir.kind.size() + nbp.cir.kind.size()) + 1;
+    size_t nodes = n * (n * jbp.rel.size() + nbp.rel.size()) + 1;
+    cir.kind.reserve(cir.kind.size() + elems);
+    cir.value.reserve(cir.value.size() + elems);
+    cir.off.reserve(cir.off.size() + elems + 1);
+    cir.node.reserve(cir.node.size() + nodes);
+    cir.copies.reserve(cir.copies.size() + n * (n + 1));
+
     // now we need to go through and define each j(x)
+    vector<int> jpar(4, 0), npar(n + 3, 0);
     for (int hill = 0; hill < n; hill++){
+        all.conn.row[hill] = cir.kind.size();
         for (int axn = 0; axn < n; axn++){
-            all = junction(all, axn, hill, rval, cval);
+            if (jbp.ok){
+                jpar[1] = all.nl.index;
+                jpar[2] = all.conn.axon[axn];
+                jpar[3] = hill;
+                stamp(cir, jprint, jpar);
+                all.nl.index += jbp.advance;
+                all.conn.synapse[hill][axn] = all.nl.index;
+            }
+            else{
+                all = junction(all, axn, hill, rval, cval);
+            }
             cout << all.conn.synapse[hill][axn] << '\n';
 
         }
 
-        all = neuron(all, thresh, rval, cval, hill);
+        if (nbp.ok){
+            npar[1] = all.nl.index;
+            npar[2] = all.conn.axon[hill];
+            for (int i = 0; i < n; i++){
+                npar[3 + i] = all.conn.synapse[hill][i];
+            }
+            stamp(cir, nprint, npar);
+            all.nl.index += nbp.advance;
+        }
+        else{
+            all = neuron(all, thresh, rval, cval, hill);
+        }
     }
 
+    all.conn.row[n] = cir.kind.size();
+
     // now we need to append the voltages and such
     // thresh
-    all.nl.str.append("v1 " + to_string_with_precision(thresh.forw, p) + " dc "
-                       + to_string_with_precision(thresh.value, p) + "\n");
+    all.nl = wvol(all.nl, thresh);
 
-    // Adding the model for the diodes
-    all.nl.str.append(".model mod1 d \n");
-    all.nl.str.append(" .end");
+    return all;
+}
 
-    // Actual writing to a file is easy
-    output << all.nl.str << '\n';
+// Checks run on the whole circuit in a few linear passes:
+//     floating:   node without a DC path to ground (only caps or source
+//                 control inputs attached)
+//     single:     node with only one terminal on it
+//     duplicate:  same kind, value and nodes as another element
+report validate(const circuit &cir, ostream &log){
+
+    auto start = chrono::steady_clock::now();
+    report rep = {};
+    const int max_listed = 8;
+    int count = cir.kind.size(), nodes = 1;
+
+    for (int v : cir.node){
+        nodes = max(nodes, v + 1);
+    }
+
+    // terminal count per node, DC connectivity through a union-find
+    vector<int> degree(nodes, 0), root(nodes);
+    for (int v = 0; v < nodes; v++){
+        root[v] = v;
+    }
+
+    auto find = [&root](int v){
+        while (root[v] != v){
+            root[v] = root[root[v]];
+            v = root[v];
+        }
+        return v;
+    };
+
+    for (int i = 0; i < count; i++){
+        const int *nd = &cir.node[cir.off[i]];
+        for (int j = cir.off[i]; j < cir.off[i+1]; j++){
+            degree[cir.node[j]]++;
+        }
+
+        switch (cir.kind[i]){
+            case RES: case DIO:
+                root[find(nd[0])] = find(nd[1]);
+                break;
+            case CAP:
+                break;
+            // every source drives its output against ground
+            default:
+                root[find(nd[0])] = find(0);
+        }
+    }
+
+    for (int v = 1; v < nodes; v++){
+        if (degree[v] > 0 && find(v) != find(0)){
+            if (rep.floating++ < max_listed){
+                log << "floating node " << v << '\n';
+            }
+        }
+        if (degree[v] == 1){
+            if (rep.single++ < max_listed){
+                log << "single-connection node " << v << '\n';
+            }
+        }
+    }
+
+    // duplicates end up next to each other once sorted by kind, value, nodes
+    // resistors and capacitors are not polarized, so their nodes are ordered
+    auto nodeat = [&cir](int e, int j){
+        const int *nd = &cir.node[cir.off[e]];
+        if (cir.kind[e] == RES || cir.kind[e] == CAP){
+            return j == 0 ? min(nd[0], nd[1]) : max(nd[0], nd[1]);
+        }
+        return nd[j];
+    };
+
+    auto less = [&](int a, int b){
+        if (cir.kind[a] != cir.kind[b]){
+            return cir.kind[a] < cir.kind[b];
+        }
+        if (cir.value[a] != cir.value[b]){
+            return cir.value[a] < cir.value[b];
+        }
+        int ca = cir.off[a+1] - cir.off[a], cb = cir.off[b+1] - cir.off[b];
+        if (ca != cb){
+            return ca < cb;
+        }
+        for (int j = 0; j < ca; j++){
+            if (nodeat(a, j) != nodeat(b, j)){
+                return nodeat(a, j) < nodeat(b, j);
+            }
+        }
+        return false;
+    };
+
+    vector<int> order(count);
+    for (int i = 0; i < count; i++){
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), less);
+
+    for (int i = 1; i < count; i++){
+        if (!less(order[i-1], order[i])){
+            if (rep.duplicate++ < max_listed){
+                log << "duplicate elements " << order[i-1] << " and "
+                    << order[i] << '\n';
+            }
+        }
+    }
+
+    double ms = chrono::duration<double, milli>(
+                    chrono::steady_clock::now() - start).count();
+
+    log << "validate: " << count << " elements, " << nodes - 1 << " nodes, "
+        << rep.floating << " floating, " << rep.single
+        << " single-connection, " << rep.duplicate << " duplicate ("
+        << ms << " ms)\n";
+
+    return rep;
+}
+
+// Every element connects all of its nodes to each other in the MNA matrix
+void adjacency(const circuit &cir, vector<int> &start, vector<int> &adj){
+
+    int nodes = 1;
+    for (int v : cir.node){
+        nodes = max(nodes, v + 1);
+    }
+
+    vector<pair<int, int>> edges;
+    for (size_t i = 0; i < cir.kind.size(); i++){
+        for (int a = cir.off[i]; a < cir.off[i+1]; a++){
+            for (int b = cir.off[i]; b < cir.off[i+1]; b++){
+                int u = cir.node[a], v = cir.node[b];
+                if (u != v && u != 0 && v != 0){
+                    edges.push_back(make_pair(u, v));
+                }
+            }
+        }
+    }
+
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+    start.assign(nodes + 1, 0);
+    adj.resize(edges.size());
+    for (auto &e : edges){
+        start[e.first + 1]++;
+    }
+    for (int v = 0; v < nodes; v++){
+        start[v + 1] += start[v];
+    }
+    for (size_t i = 0; i < edges.size(); i++){
+        adj[i] = edges[i].second;
+    }
+}
+
+int bandwidth(const circuit &cir){
+
+    vector<int> start, adj;
+    int bw = 0;
+
+    adjacency(cir, start, adj);
+    for (size_t v = 0; v + 1 < start.size(); v++){
+        for (int k = start[v]; k < start[v+1]; k++){
+            bw = max(bw, abs(adj[k] - (int)v));
+        }
+    }
+
+    return bw;
+}
+
+// Each connected component is started from a pseudo-peripheral node: a
+// lowest degree node of the last BFS level from a lowest degree seed. The
+// BFS then visits neighbours by increasing degree and the order is reversed.
+vector<int> rcm_order(const vector<int> &start, const vector<int> &adj,
+                      const vector<char> &used){
+
+    int nodes = start.size() - 1;
+    vector<int> degree(nodes), order, level(nodes, -1);
+    order.reserve(nodes);
+
+    for (int v = 0; v < nodes; v++){
+        degree[v] = start[v+1] - start[v];
+    }
+
+    auto by_degree = [&degree](int a, int b){
+        return degree[a] < degree[b] || (degree[a] == degree[b] && a < b);
+    };
+
+    // plain BFS from root, returns a lowest degree node of the last level
+    vector<int> queue;
+    auto last_level = [&](int root){
+        queue.assign(1, root);
+        level[root] = 0;
+        for (size_t q = 0; q < queue.size(); q++){
+            int v = queue[q];
+            for (int k = start[v]; k < start[v+1]; k++){
+                if (level[adj[k]] < 0){
+                    level[adj[k]] = level[v] + 1;
+                    queue.push_back(adj[k]);
+                }
+            }
+        }
+        int far = root;
+        for (int v : queue){
+            if (level[v] > level[far] ||
+                (level[v] == level[far] && by_degree(v, far))){
+                far = v;
+            }
+        }
+        for (int v : queue){
+            level[v] = -1;
+        }
+        return far;
+    };
+
+    vector<int> seeds;
+    for (int v = 0; v < nodes; v++){
+        if (used[v]){
+            seeds.push_back(v);
+        }
+    }
+    sort(seeds.begin(), seeds.end(), by_degree);
+
+    vector<char> visited(nodes, 0);
+    vector<int> nbrs;
+    for (int seed : seeds){
+        if (visited[seed]){
+            continue;
+        }
+
+        int root = last_level(seed);
+        size_t head = order.size();
+        order.push_back(root);
+        visited[root] = 1;
+
+        while (head < order.size()){
+            int v = order[head++];
+            nbrs.clear();
+            for (int k = start[v]; k < start[v+1]; k++){
+                if (!visited[adj[k]]){
+                    visited[adj[k]] = 1;
+                    nbrs.push_back(adj[k]);
+                }
+            }
+            sort(nbrs.begin(), nbrs.end(), by_degree);
+            order.insert(order.end(), nbrs.begin(), nbrs.end());
+        }
+    }
+
+    reverse(order.begin(), order.end());
+
+    return order;
+}
+
+// Explicit elimination: when a vertex goes, its remaining neighbours become
+// a clique, so its degree then is the size of its column of L. The next
+// vertex is the one of lowest current degree (the lower number on ties);
+// queue entries whose degree has changed since are skipped.
+vector<int> min_degree(const vector<int> &start, const vector<int> &adj,
+                       size_t limit, size_t &fill){
+
+    int size = start.size() - 1;
+    vector<vector<int>> nb(size);
+    priority_queue<pair<int, int>, vector<pair<int, int>>,
+                   greater<pair<int, int>>> queue;
+
+    for (int v = 0; v < size; v++){
+        nb[v].assign(adj.begin() + start[v], adj.begin() + start[v + 1]);
+        queue.push(make_pair(nb[v].size(), v));
+    }
+
+    vector<char> gone(size, 0);
+    vector<int> order, merged;
+    order.reserve(size);
+    fill = 0;
+
+    while (!queue.empty() && fill <= limit){
+        int degree = queue.top().first, v = queue.top().second;
+        queue.pop();
+        if (gone[v] || degree != (int)nb[v].size()){
+            continue;
+        }
+
+        gone[v] = 1;
+        order.push_back(v);
+        fill += degree;
+
+        for (int u : nb[v]){
+            merged.clear();
+            set_union(nb[u].begin(), nb[u].end(), nb[v].begin(),
+                      nb[v].end(), back_inserter(merged));
+            merged.erase(remove_if(merged.begin(), merged.end(),
+                                   [&](int w){ return w == u || w == v; }),
+                         merged.end());
+            nb[u].swap(merged);
+            queue.push(make_pair(nb[u].size(), u));
+        }
+        vector<int>().swap(nb[v]);
+    }
+
+    return order;
+}
+
+vector<int> renumber(circuit &cir){
+
+    vector<int> start, adj;
+    adjacency(cir, start, adj);
+
+    int nodes = start.size() - 1;
+    vector<int> map(nodes, -1);
+    vector<char> used(nodes, 0);
+
+    for (int v : cir.node){
+        used[v] = 1;
+    }
+    used[0] = 0;
+
+    vector<int> order = rcm_order(start, adj, used);
+
+    // numbered from 1 so ground keeps 0
+    map[0] = 0;
+    for (size_t i = 0; i < order.size(); i++){
+        map[order[i]] = i + 1;
+    }
+
+    for (auto &v : cir.node){
+        v = map[v];
+    }
+
+    return map;
+}
+
+// Cards are written as the SPICE deck has them; what changes between copies
+// of a block goes through put(type, arg, value), see cards and hole_type:
+//     NODE:   arg is the node entry of the element, value the node
+//     COUNT:  arg is the element letter (r c d e v b)
+//     VALUE:  arg is i, where the value field starts
+// so emit writes them as it goes and format_cards leaves holes for them.
+// With width > 0 every value field (unit included) is right aligned to width
+// characters.
+template <typename Put>
+void card(string &buf, const circuit &cir, size_t i, int width, Put put){
+
+    const int *nd = &cir.node[cir.off[i]];
+    int cnt = cir.off[i+1] - cir.off[i];
+    int k = cir.kind[i], letter = min(k, (int)BSUM);
+    double val = cir.value[i];
+    char text[64];
+
+    // appends " <value><unit>\n"
+    auto value_field = [&](const char *unit){
+        buf += ' ';
+        put(VALUE, i, 0);
+        int fw = width > 0 ? width - strlen(unit) : 0;
+        snprintf(text, sizeof(text), "%*.*g%s\n", fw, p, val, unit);
+        buf.append(text);
+    };
+
+    buf += "rcdevb"[letter];
+    put(COUNT, letter, 0);
+
+    switch (k){
+        case RES:
+        case CAP:
+        case DIO:
+            buf += ' ';
+            put(NODE, 0, nd[0]);
+            buf += ' ';
+            put(NODE, 1, nd[1]);
+            if (k == DIO){
+                buf.append(" mod1\n");
+            }
+            else{
+                value_field(k == RES ? "k" : "u");
+            }
+            break;
+        case VCVS:
+            buf += ' ';
+            put(NODE, 0, nd[0]);
+            buf.append(" 0 ");
+            put(NODE, 1, nd[1]);
+            buf += ' ';
+            put(NODE, 2, nd[2]);
+            value_field("k");
+            break;
+        case VDC:
+            buf += ' ';
+            put(NODE, 0, nd[0]);
+            buf.append(" dc");
+            value_field("");
+            break;
+        default:
+            buf += ' ';
+            put(NODE, 0, nd[0]);
+            buf.append(" 0 v=");
+            if (val != 1){
+                snprintf(text, sizeof(text), "%.*g*", p, val);
+                buf.append(text);
+            }
+            if (k == BSUM){
+                buf.append("-(");
+                for (int j = 1; j < cnt; j++){
+                    buf.append(j > 1 ? "+v(" : "v(");
+                    put(NODE, j, nd[j]);
+                    buf += ')';
+                }
+                buf.append(")\n");
+            }
+            else{
+                buf.append("v(");
+                put(NODE, 1, nd[1]);
+                buf.append(k == BDIF ? ")-v(" : ")*v(");
+                put(NODE, 2, nd[2]);
+                buf.append(")\n");
+            }
+    }
 }
 
+// The nodes of the holes are counted from the first node of the block, the
+// value fields from its first element
+void format_cards(cards &cd, const circuit &cir, int width){
+
+    cd.text.clear();
+    cd.holes.clear();
+
+    for (size_t i = 0; i < cir.kind.size(); i++){
+        card(cd.text, cir, i, width, [&](int type, int arg, int){
+            if (type == NODE){
+                arg += cir.off[i];
+            }
+            hole h = {(int)cd.text.size(), type, arg};
+            cd.holes.push_back(h);
+        });
+    }
+}
+
+// digits are collected backwards, there are at most 10 of them
+char *put_int(char *out, int v){
+
+    char digits[10];
+    int k = 0;
+    do{
+        digits[k++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+
+    while (k > 0){
+        *out++ = digits[--k];
+    }
+
+    return out;
+}
+
+// Element names count per letter in circuit order, voltage sources from 1 so
+// the threshold source stays v1
+// With width > 0 every value field (unit included) is right aligned to width
+// characters and its byte offset in the deck is pushed to index, so the
+// value can be rewritten in place later.
+// Blocks stamped from a blueprint are copied from its card text with only
+// the holes filled in; the rest goes through card one element at a time.
+void emit(const circuit &cir, ostream &output, int width,
+          vector<field> *index){
+
+    // cards are formatted into a buffer that is flushed in large blocks
+    const size_t block = 1 << 16;
+    string buf;
+    char digits[12];
+    // next number per element letter r c d e v b
+    int count[6] = {0, 0, 0, 0, 1, 0};
+    unsigned long long written = 0;
+
+    buf.reserve(block + 256);
+    buf.append("BIAS Circuit \n");
+
+    auto put = [&](int type, int arg, int value){
+        if (type == NODE){
+            buf.append(digits, put_int(digits, value) - digits);
+        }
+        else if (type == COUNT){
+            buf.append(digits, put_int(digits, count[arg]++) - digits);
+        }
+        else if (index){
+            field f = {written + buf.size(), arg, FIXED};
+            index->push_back(f);
+        }
+    };
+
+    size_t elems = cir.kind.size(), next = 0;
+    for (size_t i = 0; i < elems; ){
+        // card text of the copy starting here, if there is one at this width
+        const cards *cd = nullptr;
+        size_t size = 0;
+        if (next < cir.copies.size() && (size_t)cir.copies[next].first == i){
+            const blueprint &bp = *cir.copies[next++].bp;
+            if (width == 0 || width == field_width){
+                cd = width == 0 ? &bp.plain : &bp.fixed;
+                size = bp.cir.kind.size();
+            }
+        }
+
+        if (!cd){
+            card(buf, cir, i, width, put);
+            i++;
+        }
+        else{
+            // room for the text and the longest number in every hole
+            size_t at = buf.size();
+            buf.resize(at + cd->text.size() + 10 * cd->holes.size());
+            char *out = &buf[at];
+            const char *text = cd->text.data();
+            const int *nd = &cir.node[cir.off[i]];
+            int from = 0;
+
+            for (const hole &h : cd->holes){
+                memcpy(out, text + from, h.at - from);
+                out += h.at - from;
+                from = h.at;
+                if (h.type == NODE){
+                    out = put_int(out, nd[h.arg]);
+                }
+                else if (h.type == COUNT){
+                    out = put_int(out, count[h.arg]++);
+                }
+                else if (index){
+                    field f = {written + (out - buf.data()), (int)i + h.arg,
+                               FIXED};
+                    index->push_back(f);
+                }
+            }
+            memcpy(out, text + from, cd->text.size() - from);
+            out += cd->text.size() - from;
+            buf.resize(out - buf.data());
+            i += size;
+        }
+
+        if (buf.size() > block){
+            output.write(buf.data(), buf.size());
+            written += buf.size();
+            buf.clear();
+        }
+    }
+
+    // Adding the model for the diodes
+    buf.append(".model mod1 d \n");
+    buf.append(" .end\n");
+
+    output.write(buf.data(), buf.size());
+}
+
+// Slot of entry (r, c) in lu, see struct mna; (r, c) has to be in the
+// pattern. L(r, c) is found in column c, U(r, c) under the same index in
+// row r.
+size_t slot(const mna &m, int r, int c){
+
+    if (r == c){
+        return r;
+    }
+
+    int j = min(r, c), i = max(r, c);
+    const int *rows = m.row.data();
+    size_t k = lower_bound(rows + m.colp[j], rows + m.colp[j + 1], i) - rows;
+
+    return m.size + (r < c ? m.colp[m.size] : 0) + k;
+}
+
+// Adds v at (r, c); -1 is ground and left out. While the pattern is being
+// collected only the position is recorded; after that the calls come in the
+// same order, so the k-th one goes to slots[k].
+inline void add(mna &m, int r, int c, double v){
+
+    if (r < 0 || c < 0){
+        return;
+    }
+    if (m.pattern){
+        m.pattern->push_back(make_pair(r, c));
+        return;
+    }
+    if (!m.held){
+        m.lu[m.slots[m.next++]] += v;
+    }
+}
+
+inline void add_rhs(mna &m, int r, double v){
+
+    if (r >= 0 && !m.pattern){
+        m.rhs[r] += v;
+    }
+}
+
+// SPICE pnjlim: keeps Newton from jumping far up the diode exponential
+double pnjlim(double vnew, double vold){
+
+    const double vcrit = diode_vt * log(diode_vt / (sqrt(2.0) * diode_is));
+
+    if (vnew > vcrit && fabs(vnew - vold) > 2 * diode_vt){
+        if (vold > 0){
+            double arg = 1 + (vnew - vold) / diode_vt;
+            return arg > 0 ? vold + diode_vt * log(arg) : vcrit;
+        }
+        return diode_vt * log(vnew / diode_vt);
+    }
+
+    return vnew;
+}
+
+// Unknowns are laid out as: used nodes, then one branch current per
+// voltage defined element. The branch equation of a source takes the row of
+// its output node and the node's KCL takes the branch row, so both
+// diagonals are non-zero. The symmetrized pattern is put in minimum degree
+// order, then the elimination tree gives the pattern of L (row k of L are
+// the nodes reached from the entries left of the diagonal in row k, going
+// up the tree until k). The factors and the slot of every stamp are fixed
+// here for the whole run.
+mna build_mna(const circuit &cir){
+
+    mna m;
+    int nodes = 1, count = cir.kind.size();
+    for (int v : cir.node){
+        nodes = max(nodes, v + 1);
+    }
+
+    m.size = 0;
+    m.singular = -1;
+    m.entries = m.next = 0;
+    m.held = false;
+    m.pattern = nullptr;
+    m.vpos.assign(nodes, -1);
+    m.bpos.assign(count, -1);
+
+    vector<char> used(nodes, 0);
+    for (int v : cir.node){
+        used[v] = 1;
+    }
+    for (int v = 1; v < nodes; v++){
+        if (used[v]){
+            m.vpos[v] = m.size++;
+            m.volt.push_back(1);
+        }
+    }
+    for (int e = 0; e < count; e++){
+        int k = cir.kind[e];
+        if (k != RES && k != CAP && k != DIO){
+            m.bpos[e] = m.size++;
+            m.volt.push_back(0);
+        }
+    }
+
+    m.kcl = m.vpos;
+    m.beq = m.bpos;
+    vector<char> claimed(nodes, 0);
+    for (int e = 0; e < count; e++){
+        int out = cir.node[cir.off[e]];
+        if (m.bpos[e] >= 0 && out != 0 && !claimed[out]){
+            claimed[out] = 1;
+            m.beq[e] = m.vpos[out];
+            m.kcl[out] = m.bpos[e];
+        }
+    }
+
+    // collect the pattern by stamping once, the calls in order
+    vector<pair<int, int>> calls;
+    vector<double> x(m.size, 0), vd(count, 0);
+    m.pattern = &calls;
+    stamp_mna(m, cir, x, x, 1, vd);
+    m.pattern = nullptr;
+
+    vector<pair<int, int>> edges;
+    for (auto &rc : calls){
+        if (rc.first != rc.second){
+            edges.push_back(rc);
+            edges.push_back(make_pair(rc.second, rc.first));
+        }
+    }
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+    vector<int> start(m.size + 1, 0), adj(edges.size());
+    for (auto &e : edges){
+        start[e.first + 1]++;
+    }
+    for (int i = 0; i < m.size; i++){
+        start[i + 1] += start[i];
+    }
+    for (size_t i = 0; i < edges.size(); i++){
+        adj[i] = edges[i].second;
+    }
+
+    // L and U are the same size, so the ordering can give up at half of
+    // what the limit leaves after the diagonal
+    size_t lower = 0, room = 0;
+    if ((size_t)m.size < lu_limit){
+        room = (lu_limit - m.size) / 2;
+    }
+    vector<int> order = min_degree(start, adj, room, lower);
+    m.entries = m.size + 2 * lower;
+    if (m.entries > lu_limit){
+        return m;
+    }
+
+    vector<int> pos(m.size);
+    vector<char> volt(m.size);
+    for (int i = 0; i < m.size; i++){
+        pos[order[i]] = i;
+        volt[i] = m.volt[order[i]];
+    }
+    m.volt = volt;
+
+    for (auto *p : {&m.vpos, &m.bpos, &m.kcl, &m.beq}){
+        for (auto &i : *p){
+            if (i >= 0){
+                i = pos[i];
+            }
+        }
+    }
+
+    // elimination tree, with the ancestors compressed along the way
+    vector<int> parent(m.size, -1), ancestor(m.size, -1);
+    for (int k = 0; k < m.size; k++){
+        int v = order[k];
+        for (int e = start[v]; e < start[v + 1]; e++){
+            for (int i = pos[adj[e]]; i >= 0 && i < k; ){
+                int up = ancestor[i];
+                ancestor[i] = k;
+                if (up < 0){
+                    parent[i] = k;
+                }
+                i = up;
+            }
+        }
+    }
+
+    // rows of L: counted per column in a first pass over the row subtrees,
+    // filled in the second; rows come out ascending in every column
+    vector<int> mark(m.size, -1);
+    vector<size_t> length(m.size, 0);
+    auto row_subtree = [&](int k, bool keep){
+        int v = order[k];
+        mark[k] = k;
+        for (int e = start[v]; e < start[v + 1]; e++){
+            for (int j = pos[adj[e]]; j < k && mark[j] != k; j = parent[j]){
+                mark[j] = k;
+                if (keep){
+                    m.row[m.colp[j] + length[j]] = k;
+                }
+                length[j]++;
+            }
+        }
+    };
+
+    for (int k = 0; k < m.size; k++){
+        row_subtree(k, false);
+    }
+    m.colp.assign(m.size + 1, 0);
+    for (int j = 0; j < m.size; j++){
+        m.colp[j + 1] = m.colp[j] + length[j];
+    }
+    m.row.resize(m.colp[m.size]);
+    fill(mark.begin(), mark.end(), -1);
+    fill(length.begin(), length.end(), 0);
+    for (int k = 0; k < m.size; k++){
+        row_subtree(k, true);
+    }
+
+    m.entries = m.size + 2 * m.colp[m.size];
+    m.lu.assign(m.entries, 0);
+    m.rhs.assign(m.size, 0);
+
+    m.slots.resize(calls.size());
+    for (size_t k = 0; k < calls.size(); k++){
+        m.slots[k] = slot(m, pos[calls[k].first], pos[calls[k].second]);
+    }
+
+    return m;
+}
+
+// Backward Euler companions for capacitors, linearized diodes and
+// multipliers around the iterate x, everything else as is.
+// Values are in card units, see struct circuit.
+bool stamp_mna(mna &m, const circuit &cir, const vector<double> &x,
+               const vector<double> &xold, double dt, vector<double> &vd){
+
+    const double gmin = 1e-12, rmin = 1e-3;
+    bool limited = false;
+    m.next = 0;
+
+    auto V = [&m](int v){
+        return v ? m.vpos[v] : -1;
+    };
+    auto K = [&m](int v){
+        return v ? m.kcl[v] : -1;
+    };
+    auto volt = [&m](const vector<double> &s, int v){
+        return v ? s[m.vpos[v]] : 0.0;
+    };
+    auto conductance = [&](int a, int b, double g){
+        add(m, K(a), V(a), g);
+        add(m, K(a), V(b), -g);
+        add(m, K(b), V(a), -g);
+        add(m, K(b), V(b), g);
+    };
+
+    // every node sees gmin to ground, which also holds floating nodes
+    for (size_t v = 1; v < m.vpos.size(); v++){
+        if (m.vpos[v] >= 0){
+            add(m, m.kcl[v], m.vpos[v], gmin);
+        }
+    }
+
+    for (size_t e = 0; e < cir.kind.size(); e++){
+        const int *nd = &cir.node[cir.off[e]];
+        int cnt = cir.off[e+1] - cir.off[e];
+        double val = cir.value[e];
+        int b = m.bpos[e], row = m.beq[e];
+
+        switch (cir.kind[e]){
+            case RES:
+                conductance(nd[0], nd[1], 1 / max(val * 1e3, rmin));
+                break;
+            case CAP:{
+                double g = val * 1e-6 / dt;
+                double ih = g * (volt(xold, nd[0]) - volt(xold, nd[1]));
+                conductance(nd[0], nd[1], g);
+                add_rhs(m, K(nd[0]), ih);
+                add_rhs(m, K(nd[1]), -ih);
+                break;
+            }
+            case DIO:{
+                double vnew = volt(x, nd[0]) - volt(x, nd[1]);
+                double v = pnjlim(vnew, vd[e]);
+                limited |= v != vnew;
+                vd[e] = v;
+                double ex = exp(v / diode_vt);
+                double g = diode_is / diode_vt * ex + gmin;
+                double ieq = diode_is * (ex - 1) - g * v;
+                conductance(nd[0], nd[1], g);
+                add_rhs(m, K(nd[0]), -ieq);
+                add_rhs(m, K(nd[1]), ieq);
+                break;
+            }
+            case VDC:
+                add(m, K(nd[0]), b, 1);
+                add(m, row, V(nd[0]), 1);
+                add_rhs(m, row, val);
+                break;
+            case VCVS:
+                add(m, K(nd[0]), b, 1);
+                add(m, row, V(nd[0]), 1);
+                add(m, row, V(nd[1]), -val * 1e3);
+                add(m, row, V(nd[2]), val * 1e3);
+                break;
+            case BSUM:
+                add(m, K(nd[0]), b, 1);
+                add(m, row, V(nd[0]), 1);
+                for (int j = 1; j < cnt; j++){
+                    add(m, row, V(nd[j]), val);
+                }
+                break;
+            case BDIF:
+                add(m, K(nd[0]), b, 1);
+                add(m, row, V(nd[0]), 1);
+                add(m, row, V(nd[1]), -val);
+                add(m, row, V(nd[2]), val);
+                break;
+            case BMUL:{
+                double va = volt(x, nd[1]), vb = volt(x, nd[2]);
+                add(m, K(nd[0]), b, 1);
+                add(m, row, V(nd[0]), 1);
+                add(m, row, V(nd[1]), -val * vb);
+                add(m, row, V(nd[2]), -val * va);
+                add_rhs(m, row, -val * va * vb);
+                break;
+            }
+        }
+    }
+
+    return limited;
+}
+
+// Left-looking LU in place in the pattern: step k gathers column k of L and
+// row k of U from the columns j < k with L(k, j) != 0. Those are kept in a
+// linked list per row (head / link); once column j has been used at row k
+// it moves on to the list of its next row. Updates go to dense work rows
+// and are copied back into the pattern. There is no pivoting, so a pivot
+// too small to divide by means the matrix is singular (as in SPICE: a loop
+// of sources, a node driven twice) and stops here.
+bool factor_mna(mna &m){
+
+    const double tiny = 1e-18;
+    int size = m.size;
+    const size_t *colp = m.colp.data();
+    const int *row = m.row.data();
+    double *d = m.lu.data(), *l = d + size, *u = l + colp[size];
+
+    vector<double> wl(size, 0), wu(size, 0);
+    vector<int> head(size, -1), link(size, -1);
+    // entry of column j at the row it is listed under
+    vector<size_t> at(size);
+
+    auto enlist = [&](int j){
+        if (at[j] < colp[j + 1]){
+            int r = row[at[j]];
+            link[j] = head[r];
+            head[r] = j;
+        }
+    };
+
+    for (int k = 0; k < size; k++){
+        for (size_t q = colp[k]; q < colp[k + 1]; q++){
+            wl[row[q]] = l[q];
+            wu[row[q]] = u[q];
+        }
+
+        double dk = d[k];
+        for (int j = head[k]; j >= 0; ){
+            int after = link[j];
+            size_t p = at[j];
+            double lkj = l[p], ujk = u[p];
+            dk -= lkj * ujk;
+            for (size_t q = p + 1; q < colp[j + 1]; q++){
+                wl[row[q]] -= l[q] * ujk;
+                wu[row[q]] -= lkj * u[q];
+            }
+            at[j] = p + 1;
+            enlist(j);
+            j = after;
+        }
+
+        if (!(fabs(dk) >= tiny)){
+            m.singular = k;
+            return false;
+        }
+        d[k] = dk;
+
+        for (size_t q = colp[k]; q < colp[k + 1]; q++){
+            int i = row[q];
+            l[q] = wl[i] / dk;
+            u[q] = wu[i];
+            wl[i] = wu[i] = 0;
+        }
+        at[k] = colp[k];
+        enlist(k);
+    }
+
+    return true;
+}
+
+string unknown_name(const mna &m, int i){
+
+    for (size_t v = 0; v < m.vpos.size(); v++){
+        if (m.vpos[v] == i){
+            return "node " + to_string(v);
+        }
+    }
+    for (size_t e = 0; e < m.bpos.size(); e++){
+        if (m.bpos[e] == i){
+            return "the branch of element " + to_string(e);
+        }
+    }
+
+    return "unknown " + to_string(i);
+}
+
+// Forward substitution by columns of L, back substitution by rows of U;
+// the solution replaces rhs
+void solve_mna(mna &m){
+
+    int size = m.size;
+    const size_t *colp = m.colp.data();
+    const int *row = m.row.data();
+    const double *d = m.lu.data(), *l = d + size, *u = l + colp[size];
+    double *x = m.rhs.data();
+
+    for (int j = 0; j < size; j++){
+        double xj = x[j];
+        for (size_t q = colp[j]; q < colp[j + 1]; q++){
+            x[row[q]] -= l[q] * xj;
+        }
+    }
+
+    for (int k = size - 1; k >= 0; k--){
+        double s = x[k];
+        for (size_t q = colp[k]; q < colp[k + 1]; q++){
+            s -= u[q] * x[row[q]];
+        }
+        x[k] = s / d[k];
+    }
+}
+
+// Fixed step backward Euler from all zeros (like SPICE uic). The MNA
+// structure is built once, each Newton iteration only restamps values and
+// refactors. Linear circuits take a single iteration per step, and as the
+// step is fixed their matrix is too: it is factored once and every step
+// only restamps the right hand side and solves. A singular matrix, a step
+// that does not converge or factors over lu_limit end the run with tr.error
+// set.
+void simulate(const circuit &cir, transient &tr){
+
+    const int max_newton = 50;
+    const double vtol = 1e-6, itol = 1e-12, reltol = 1e-3;
+    auto start = chrono::steady_clock::now();
+
+    mna m = build_mna(cir);
+
+    tr.steps = tr.newton = tr.factors = 0;
+    tr.unknowns = m.size;
+    tr.entries = m.entries;
+    tr.error.clear();
+    if (m.entries > lu_limit){
+        ostringstream msg;
+        msg << "LU factors too large, at least " << m.entries
+            << " entries (limit " << lu_limit << ")";
+        tr.error = msg.str();
+        tr.ms = chrono::duration<double, milli>(
+                    chrono::steady_clock::now() - start).count();
+        return;
+    }
+
+    bool linear = true;
+    for (char k : cir.kind){
+        linear &= k != DIO && k != BMUL;
+    }
+
+    vector<double> x(m.size, 0), xold(m.size, 0), vd(cir.kind.size(), 0);
+    int steps = ceil(tr.tstop / tr.dt - 1e-9);
+
+    auto record = [&](double t){
+        tr.time.push_back(t);
+        for (int v : tr.probes){
+            tr.wave.push_back(v > 0 && m.vpos[v] >= 0 ? x[m.vpos[v]] : 0);
+        }
+    };
+
+    tr.time.reserve(steps + 1);
+    tr.wave.reserve((steps + 1) * tr.probes.size());
+    record(0);
+
+    auto stop = [&](const string &why, int s){
+        ostringstream msg;
+        msg << why << " at t = " << s * tr.dt;
+        tr.error = msg.str();
+    };
+
+    for (int s = 1; s <= steps && tr.error.empty(); s++){
+        bool converged = false;
+
+        for (int it = 0; it < max_newton && !converged; it++){
+            if (!m.held){
+                fill(m.lu.begin(), m.lu.end(), 0);
+            }
+            fill(m.rhs.begin(), m.rhs.end(), 0);
+
+            bool limited = stamp_mna(m, cir, x, xold, tr.dt, vd);
+            if (!m.held){
+                if (!factor_mna(m)){
+                    stop("singular matrix at " + unknown_name(m, m.singular),
+                         s);
+                    break;
+                }
+                tr.factors++;
+                m.held = linear;
+            }
+            solve_mna(m);
+
+            converged = linear;
+            if (!linear && !limited && it > 0){
+                converged = true;
+                for (int i = 0; i < m.size && converged; i++){
+                    double tol = (m.volt[i] ? vtol : itol)
+                                 + reltol * max(fabs(x[i]), fabs(m.rhs[i]));
+                    converged = fabs(m.rhs[i] - x[i]) <= tol;
+                }
+            }
+
+            x.swap(m.rhs);
+            tr.newton++;
+        }
+
+        if (!tr.error.empty()){
+            break;
+        }
+        if (!converged){
+            stop("no convergence", s);
+            break;
+        }
+
+        xold = x;
+        tr.steps++;
+        record(s * tr.dt);
+    }
+
+    tr.ms = chrono::duration<double, milli>(
+                chrono::steady_clock::now() - start).count();
+}
+
+// A 1 V source feeding: a 1k / 1u RC (node 2), 1k into a diode (node 3), an
+// inverting amp of gain -2 (node 5), a multiplier v(5) * v(3) (node 6) and a
+// summing source -(v(6) + v(1)) (node 7). Values at t = 1 ms = RC by hand:
+// 1 - 1/e, the diode drop from (1 - v) / 1k = Is (exp(v / Vt) - 1), -2,
+// their product and -(product + 1). The RC on its own is linear, so it has
+// to come out the same from a single factorization. A second source on
+// node 1 makes the matrix singular, which has to stop the run.
+int check_solver(){
+
+    struct expect{
+        const char *what;
+        int node;
+        double value;
+    };
+
+    const double tol = 1e-3, drop = 0.629147;
+    const expect checks[] = {
+        {"RC charge at t = RC", 2, 1 - exp(-1.0)},
+        {"diode drop", 3, drop},
+        {"inverting amp", 5, -2},
+        {"multiplier", 6, -2 * drop},
+        {"summing source", 7, 2 * drop - 1},
+    };
+
+    circuit cir;
+    auto elem = [&cir](int k, double value, vector<int> nodes){
+        add_elem(cir, k, value, nodes.data(), nodes.size());
+    };
+
+    elem(VDC, 1, {1});
+    elem(RES, 1, {1, 2});
+    elem(CAP, 1, {2, 0});
+    elem(RES, 1, {1, 3});
+    elem(DIO, 0, {3, 0});
+    elem(RES, 1, {1, 4});
+    elem(RES, 2, {4, 5});
+    elem(VCVS, 999, {5, 0, 4});
+    elem(BMUL, 1, {6, 5, 3});
+    elem(BSUM, 1, {7, 6, 1});
+
+    transient tr = {};
+    tr.tstop = 1e-3;
+    tr.dt = 1e-6;
+    for (auto &c : checks){
+        tr.probes.push_back(c.node);
+    }
+
+    simulate(cir, tr);
+
+    int failed = 0;
+    if (!tr.error.empty()){
+        cerr << "check: " << tr.error << '\n';
+        failed++;
+    }
+    else{
+        size_t np = tr.probes.size(), last = tr.time.size() - 1;
+        for (size_t j = 0; j < np; j++){
+            double v = tr.wave[last * np + j];
+            bool ok = fabs(v - checks[j].value) <= tol;
+            cerr << "check: " << checks[j].what << ' ' << v << " V, expected "
+                 << checks[j].value << (ok ? "" : " FAILED") << '\n';
+            failed += !ok;
+        }
+    }
+
+    circuit rc;
+    const int rc_nodes[] = {1, 2, 0};
+    add_elem(rc, VDC, 1, rc_nodes, 1);
+    add_elem(rc, RES, 1, rc_nodes, 2);
+    add_elem(rc, CAP, 1, rc_nodes + 1, 2);
+
+    transient lin = {};
+    lin.tstop = 1e-3;
+    lin.dt = 1e-6;
+    lin.probes.push_back(2);
+    simulate(rc, lin);
+
+    double v = lin.error.empty() ? lin.wave.back() : NAN;
+    bool once = lin.factors == 1 && fabs(v - checks[0].value) <= tol;
+    cerr << "check: linear RC " << v << " V from " << lin.factors
+         << " factorization(s)" << (once ? "" : " FAILED") << '\n';
+    failed += !once;
+
+    elem(VDC, 2, {1});
+    transient bad = {};
+    bad.tstop = 1e-3;
+    bad.dt = 1e-6;
+    simulate(cir, bad);
+
+    bool stopped = bad.error.find("singular") != string::npos;
+    cerr << "check: two sources on one node: "
+         << (stopped ? bad.error : "not reported FAILED") << '\n';
+    failed += !stopped;
+
+    cerr << "check: " << (failed ? "failed" : "passed") << '\n';
+
+    return failed;
+}
+
+// Partition p holds the junctions and the neuron of hillock row p, the
+// elements after the last row (the threshold source) go into every deck.
+// A node used by more than one partition is a port. Its driver is the one
+// partition with a source output on it; without one, the row of the neuron
+// for an axon, otherwise the first partition using it. The driver deck gets
+// a load resistor standing for the resistors the other partitions hang on
+// the port; every other deck gets a 0 V source on the port, to be replaced
+// by the driver's waveform when the partitions are stitched together.
+// A port driven by sources in several partitions cannot be cut there (the
+// decks would hold sources in parallel): such ports are listed as errors in
+// the manifest and no decks are written.
+int write_partitions(const circuit &cir, const connectome &grid,
+                     ostream &manifest, const string &prefix, bool gzip){
+
+    string suffix = gzip ? ".net.gz" : ".net";
+    int status = 0;
+
+    int nodes = 1, count = cir.kind.size();
+    for (int v : cir.node){
+        nodes = max(nodes, v + 1);
+    }
+
+    vector<int> part(count, -1);
+    for (int p = 0; p < n; p++){
+        for (int e = grid.row[p]; e < grid.row[p+1]; e++){
+            part[e] = p;
+        }
+    }
+
+    // partitions using every node
+    vector<vector<int>> users(nodes);
+    for (int e = 0; e < count; e++){
+        if (part[e] < 0){
+            continue;
+        }
+        for (int j = cir.off[e]; j < cir.off[e+1]; j++){
+            vector<int> &u = users[cir.node[j]];
+            if (find(u.begin(), u.end(), part[e]) == u.end()){
+                u.push_back(part[e]);
+            }
+        }
+    }
+
+    vector<int> axon_of(nodes, -1), driver(nodes, -1);
+    for (int i = 0; i < n; i++){
+        axon_of[grid.axon[i]] = i;
+    }
+
+    // nodes driven by the shared elements have a copy of their source in
+    // every deck already
+    vector<char> shared(nodes, 0);
+    for (int e = 0; e < count; e++){
+        int k = cir.kind[e];
+        if (part[e] < 0 && k != RES && k != CAP && k != DIO){
+            shared[cir.node[cir.off[e]]] = 1;
+        }
+    }
+
+    // partitions with a source output on every node
+    vector<vector<int>> sources(nodes);
+    for (int e = 0; e < count; e++){
+        int out = cir.node[cir.off[e]], k = cir.kind[e];
+        vector<int> &s = sources[out];
+        if (k != RES && k != CAP && k != DIO && part[e] >= 0 &&
+            find(s.begin(), s.end(), part[e]) == s.end()){
+            s.push_back(part[e]);
+        }
+    }
+
+    vector<int> ports, conflicts;
+    for (int v = 1; v < nodes; v++){
+        if (users[v].size() < 2 || shared[v]){
+            continue;
+        }
+        sort(users[v].begin(), users[v].end());
+        sort(sources[v].begin(), sources[v].end());
+        if (sources[v].size() > 1){
+            conflicts.push_back(v);
+            continue;
+        }
+        ports.push_back(v);
+        if (!sources[v].empty()){
+            driver[v] = sources[v][0];
+        }
+        else{
+            driver[v] = axon_of[v] >= 0 ? axon_of[v] : users[v][0];
+        }
+    }
+
+    // conductance the other partitions put on each port through resistors
+    vector<double> load(nodes, 0);
+    for (int e = 0; e < count; e++){
+        if (cir.kind[e] != RES || part[e] < 0 || cir.value[e] <= 0){
+            continue;
+        }
+        for (int j = cir.off[e]; j < cir.off[e+1]; j++){
+            int v = cir.node[j];
+            if (driver[v] >= 0 && driver[v] != part[e]){
+                load[v] += 1 / (cir.value[e] * 1e3);
+            }
+        }
+    }
+
+    manifest << "# BIAS partition manifest\n"
+             << "# partition <id> <deck> <elements>\n"
+             << "# port <node> <axon k | net -> driver <partition> "
+             << "readers <partitions>\n"
+             << "# error <node> <axon k | net -> driven by <partitions>\n";
+
+    for (int v : conflicts){
+        ostringstream line;
+        line << "error " << v << ' ';
+        if (axon_of[v] >= 0){
+            line << "axon " << axon_of[v];
+        }
+        else{
+            line << "net -";
+        }
+        line << " driven by";
+        for (int p : sources[v]){
+            line << ' ' << p;
+        }
+        manifest << line.str() << '\n';
+        cerr << "partition: " << line.str() << '\n';
+    }
+    if (!conflicts.empty()){
+        cerr << "partition: " << conflicts.size() << " ports driven by more "
+             << "than one partition, no decks written\n";
+        for (int p = 0; p < n; p++){
+            remove((prefix + "_p" + to_string(p) + suffix).c_str());
+        }
+        return 1;
+    }
+
+    for (int p = 0; p < n; p++){
+        circuit deck;
+        for (int e = 0; e < count; e++){
+            if (part[e] == p || part[e] < 0){
+                add_elem(deck, cir.kind[e], cir.value[e],
+                         &cir.node[cir.off[e]], cir.off[e+1] - cir.off[e]);
+            }
+        }
+        for (int v : ports){
+            bool used = binary_search(users[v].begin(), users[v].end(), p);
+            // a deck never gets a port source on a node it drives itself
+            bool drives = binary_search(sources[v].begin(), sources[v].end(),
+                                        p);
+            if (used && driver[v] == p && load[v] > 0){
+                int nd[2] = {v, 0};
+                add_elem(deck, RES, 1 / load[v] / 1e3, nd, 2);
+            }
+            else if (used && driver[v] != p && !drives){
+                add_elem(deck, VDC, 0, &v, 1);
+            }
+        }
+
+        string name = prefix + "_p" + to_string(p) + suffix;
+        ofstream file(name, ofstream::binary);
+        bool ok = true;
+        if (gzip){
+            gzbuf zip(file, Z_DEFAULT_COMPRESSION);
+            ostream out(&zip);
+            emit(deck, out, 0, nullptr);
+            ok = zip.close();
+        }
+        else{
+            emit(deck, file, 0, nullptr);
+        }
+        file.close();
+        if (!ok || !file){
+            cerr << "could not write " << name << '\n';
+            status = 1;
+        }
+
+        manifest << "partition " << p << ' ' << name << ' '
+                 << deck.kind.size() << '\n';
+    }
+
+    for (int v : ports){
+        manifest << "port " << v << ' ';
+        if (axon_of[v] >= 0){
+            manifest << "axon " << axon_of[v];
+        }
+        else{
+            manifest << "net -";
+        }
+        manifest << " driver " << driver[v] << " readers";
+        for (int p : users[v]){
+            if (p != driver[v]){
+                manifest << ' ' << p;
+            }
+        }
+        manifest << '\n';
+    }
+
+    cerr << "partition: " << n << " decks, " << ports.size() << " ports\n";
+
+    return status;
+}
+
+// This will generate connectome and write final netlist to file
+int write_netlist(netlist net, ostream &output, double rval, double cval,
+                  options opt){
+
+    connet all = build_core(net, rval, cval);
+    int status = 0;
+
+    validate(*all.nl.cir, cerr);
+
+    if (opt.rcm){
+        auto start = chrono::steady_clock::now();
+        int before = bandwidth(*all.nl.cir);
+
+        vector<int> map = renumber(*all.nl.cir);
+
+        // keep the connectome pointing at the same nodes
+        for (int i = 0; i < n; i++){
+            all.conn.axon[i] = map[all.conn.axon[i]];
+            all.conn.hillock[i] = map[all.conn.hillock[i]];
+            for (int j = 0; j < n; j++){
+                all.conn.synapse[i][j] = map[all.conn.synapse[i][j]];
+            }
+        }
+
+        double ms = chrono::duration<double, milli>(
+                        chrono::steady_clock::now() - start).count();
+
+        cerr << "rcm: bandwidth " << before << " -> "
+             << bandwidth(*all.nl.cir) << " (" << ms << " ms)\n";
+    }
+
+    if (opt.tstop > 0){
+        transient tr = {};
+        tr.tstop = opt.tstop;
+        tr.dt = opt.dt;
+        tr.probes.assign(all.conn.axon, all.conn.axon + n);
+
+        simulate(*all.nl.cir, tr);
+
+        // nothing that could pass for a result, not even an old one
+        if (!tr.error.empty()){
+            cerr << "sim: failed, " << tr.error << '\n';
+            remove("sim.dat");
+            status = 1;
+        }
+        else{
+            ofstream wave("sim.dat");
+            size_t np = tr.probes.size();
+
+            wave << "# t";
+            for (int v : tr.probes){
+                wave << " v(" << v << ")";
+            }
+            wave << '\n';
+            for (size_t t = 0; t < tr.time.size(); t++){
+                wave << tr.time[t];
+                for (size_t j = 0; j < np; j++){
+                    wave << ' ' << tr.wave[t * np + j];
+                }
+                wave << '\n';
+            }
+
+            cerr << "sim: " << tr.unknowns << " unknowns, " << tr.entries
+                 << " LU entries, " << tr.steps << " steps, " << tr.newton
+                 << " Newton iterations, " << tr.factors
+                 << " factorizations (" << tr.ms << " ms)\n";
+        }
+    }
+
+    if (opt.parts){
+        if (write_partitions(*all.nl.cir, all.conn, output, "out",
+                             opt.gzip)){
+            status = 1;
+        }
+        return status;
+    }
+
+    // Actual writing to a file is easy
+    if (opt.index.empty()){
+        emit(*all.nl.cir, output, 0, nullptr);
+        return status;
+    }
+
+    vector<field> index;
+    emit(*all.nl.cir, output, field_width, &index);
+
+    // resistors at rval, capacitors at cval and the threshold source are the
+    // values a sweep changes
+    const circuit &cir = *all.nl.cir;
+    for (auto &f : index){
+        int k = cir.kind[f.elem];
+        if (k == RES && cir.value[f.elem] == rval){
+            f.role = RVAL;
+        }
+        else if (k == CAP && cir.value[f.elem] == cval){
+            f.role = CVAL;
+        }
+        else if (k == VDC){
+            f.role = THRESH;
+        }
+    }
+
+    output.flush();
+    if (!write_index(opt.index, index, field_width, output.tellp())){
+        cerr << "could not write " << opt.index << '\n';
+        status = 1;
+    }
+
+    return status;
+}
+
+// The index is binary: a header {magic, width, deck size, count} and then
+// the fields as they are in memory
+const char index_magic[8] = {'B', 'I', 'A', 'S', 'I', 'D', 'X', '1'};
+
+bool write_index(const string &path, const vector<field> &index, int width,
+                 unsigned long long size){
+
+    ofstream out(path, ofstream::binary);
+    unsigned long long count = index.size();
+
+    out.write(index_magic, sizeof(index_magic));
+    out.write((const char *)&width, sizeof(width));
+    out.write((const char *)&size, sizeof(size));
+    out.write((const char *)&count, sizeof(count));
+    out.write((const char *)index.data(), count * sizeof(field));
+
+    return out.good();
+}
+
+bool read_index(const string &path, vector<field> &index, int &width,
+                unsigned long long &size){
+
+    ifstream in(path, ifstream::binary | ifstream::ate);
+    char magic[sizeof(index_magic)];
+    unsigned long long count = 0;
+    unsigned long long length = in.tellg();
+
+    in.seekg(0);
+    in.read(magic, sizeof(magic));
+    in.read((char *)&width, sizeof(width));
+    in.read((char *)&size, sizeof(size));
+    in.read((char *)&count, sizeof(count));
+    if (!in || memcmp(magic, index_magic, sizeof(magic)) != 0){
+        return false;
+    }
+
+    // the fields have to fill the rest of the file exactly
+    unsigned long long header = in.tellg();
+    if (width < 1 || width > 32 || count > (length - header) / sizeof(field) ||
+        count * sizeof(field) != length - header){
+        cerr << path << " is truncated or corrupt\n";
+        return false;
+    }
+
+    index.resize(count);
+    in.read((char *)index.data(), count * sizeof(field));
+    if (!in){
+        return false;
+    }
+
+    for (auto &f : index){
+        if (f.role < FIXED || f.role >= ROLES || f.pos == 0 ||
+            f.pos + width >= size){
+            cerr << path << " has a field outside its deck\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Every new value is formatted once per role and copied over its fields.
+// All fields are checked before the first one is written: each has to sit
+// between a space and the end of its card, or the index belongs to another
+// deck of the same size.
+int patch_fields(char *deck, unsigned long long size,
+                 const vector<field> &index, int width, const double *value,
+                 const bool *set){
+
+    for (auto &f : index){
+        if (f.role < FIXED || f.role >= ROLES || f.pos == 0 ||
+            f.pos + width >= size || deck[f.pos - 1] != ' ' ||
+            deck[f.pos + width] != '\n' ||
+            memchr(deck + f.pos, '\n', width)){
+            cerr << "value field at byte " << f.pos
+                 << " does not match the deck\n";
+            return -1;
+        }
+    }
+
+    const char *units[ROLES] = {"", "k", "u", ""};
+    char text[ROLES][64];
+    for (int r = RVAL; r < ROLES; r++){
+        int fw = width - strlen(units[r]);
+        int len = snprintf(text[r], sizeof(text[r]), "%*.*g%s", fw, p,
+                           value[r], units[r]);
+        if (set[r] && len != width){
+            cerr << "value " << value[r] << " does not fit the field width\n";
+            return -1;
+        }
+    }
+
+    int patched = 0;
+    for (auto &f : index){
+        if (set[f.role] && f.role != FIXED){
+            memcpy(deck + f.pos, text[f.role], width);
+            patched++;
+        }
+    }
+
+    return patched;
+}
+
+// A plain deck is mapped shared, so only the pages holding patched fields
+// are touched and written back. A compressed deck (.gz) cannot be changed
+// in place; it is read back through zlib, patched in memory and compressed
+// again. Its index is the one written next to it, out.net.idx.
+int patch_netlist(const string &path, const double *value, const bool *set){
+
+    auto start = chrono::steady_clock::now();
+    vector<field> index;
+    int width = 0, patched = 0;
+    unsigned long long size = 0;
+    bool gz = path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0;
+    string plain = gz ? path.substr(0, path.size() - 3) : path;
+
+    if (!read_index(plain + ".idx", index, width, size)){
+        cerr << "no usable value index for " << path
+             << " (write it with -x)\n";
+        return 1;
+    }
+
+    if (gz){
+        string deck;
+        if (!read_deck(path, deck) || deck.size() != size){
+            cerr << path << " does not match its value index\n";
+            return 1;
+        }
+
+        patched = patch_fields(&deck[0], size, index, width, value, set);
+        if (patched < 0){
+            return 1;
+        }
+
+        // the deck is only replaced once the new one is written completely
+        string tmp = path + ".tmp";
+        bool ok;
+        {
+            ofstream file(tmp, ofstream::binary);
+            gzbuf zip(file, Z_DEFAULT_COMPRESSION);
+            zip.sputn(deck.data(), deck.size());
+            ok = zip.close();
+            file.close();
+            ok = ok && file;
+        }
+        if (!ok){
+            cerr << "could not write " << tmp << '\n';
+            remove(tmp.c_str());
+            return 1;
+        }
+        if (rename(tmp.c_str(), path.c_str()) != 0){
+            cerr << "could not replace " << path << ": " << strerror(errno)
+                 << '\n';
+            remove(tmp.c_str());
+            return 1;
+        }
+    }
+    else{
+        int fd = open(path.c_str(), O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 ||
+            (unsigned long long)st.st_size != size){
+            cerr << path << " does not match its value index\n";
+            if (fd >= 0){
+                close(fd);
+            }
+            return 1;
+        }
+
+        char *deck = (char *)mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, fd, 0);
+        close(fd);
+        if (deck == MAP_FAILED){
+            cerr << "could not map " << path << '\n';
+            return 1;
+        }
+
+        patched = patch_fields(deck, size, index, width, value, set);
+
+        msync(deck, size, MS_SYNC);
+        munmap(deck, size);
+
+        if (patched < 0){
+            return 1;
+        }
+    }
+
+    double ms = chrono::duration<double, milli>(
+                    chrono::steady_clock::now() - start).count();
+    cerr << "patch: " << patched << " values in " << path << " (" << ms
+         << " ms)\n";
+
+    return 0;
+}
+
+// gzread passes files that are not compressed through as they are
+bool read_deck(const string &path, string &deck){
+
+    gzFile in = gzopen(path.c_str(), "rb");
+    if (!in){
+        return false;
+    }
+
+    gzbuffer(in, 1 << 17);
+    deck.clear();
+
+    char chunk[1 << 16];
+    int got;
+    while ((got = gzread(in, chunk, sizeof(chunk))) > 0){
+        deck.append(chunk, got);
+    }
+
+    return gzclose(in) == Z_OK && got == 0;
+}
+
+gzbuf::gzbuf(ostream &output, int level)
+    : out(output), level(level), total(0), done(false), failed(false){
+
+    int workers = max(1u, thread::hardware_concurrency());
+    for (int t = 0; t < workers; t++){
+        pool.push_back(thread(&gzbuf::compress, this));
+    }
+    writer = thread(&gzbuf::write, this);
+
+    fresh();
+}
+
+gzbuf::~gzbuf(){
+    close();
+}
+
+// hands the current block to the workers, waiting while too many blocks are
+// in flight so memory stays bounded
+void gzbuf::submit(){
+
+    size_t used = pptr() - pbase();
+    if (used == 0){
+        return;
+    }
+
+    current->in.resize(used);
+    total += used;
+
+    unique_lock<mutex> hold(lock);
+    full.wait(hold, [this]{ return jobs.size() < 2 * pool.size() + 2; });
+    jobs.push_back(current);
+    current.reset();
+    ready.notify_all();
+}
+
+void gzbuf::fresh(){
+
+    current = make_shared<gzblock>();
+    current->in.resize(block_size);
+    current->done = false;
+    current->taken = false;
+    setp(&current->in[0], &current->in[0] + block_size);
+}
+
+int gzbuf::overflow(int c){
+
+    submit();
+    fresh();
+    if (c != EOF){
+        *pptr() = c;
+        pbump(1);
+    }
+
+    return c == EOF ? 0 : c;
+}
+
+// every block becomes its own gzip member
+void gzbuf::compress(){
+
+    for (;;){
+        shared_ptr<gzblock> job;
+        {
+            unique_lock<mutex> hold(lock);
+            ready.wait(hold, [this, &job]{
+                for (auto &j : jobs){
+                    if (!j->taken){
+                        job = j;
+                        return true;
+                    }
+                }
+                return done;
+            });
+            if (!job){
+                return;
+            }
+            job->taken = true;
+        }
+
+        // deflateBound leaves room for the whole member, so a single
+        // deflate call has to finish it
+        z_stream zs = {};
+        bool ok = deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8,
+                               Z_DEFAULT_STRATEGY) == Z_OK;
+        if (ok){
+            job->out.resize(deflateBound(&zs, job->in.size()));
+            zs.next_in = (Bytef *)&job->in[0];
+            zs.avail_in = job->in.size();
+            zs.next_out = (Bytef *)&job->out[0];
+            zs.avail_out = job->out.size();
+            ok = deflate(&zs, Z_FINISH) == Z_STREAM_END;
+            job->out.resize(zs.total_out);
+            deflateEnd(&zs);
+        }
+
+        lock_guard<mutex> hold(lock);
+        failed |= !ok;
+        job->done = true;
+        finished.notify_all();
+    }
+}
+
+// writes the blocks in the order they were submitted
+void gzbuf::write(){
+
+    for (;;){
+        shared_ptr<gzblock> job;
+        bool skip;
+        {
+            unique_lock<mutex> hold(lock);
+            finished.wait(hold, [this]{
+                return (!jobs.empty() && jobs.front()->done) ||
+                       (jobs.empty() && done);
+            });
+            if (jobs.empty()){
+                return;
+            }
+            job = jobs.front();
+            skip = failed;
+        }
+
+        if (!skip){
+            out.write(job->out.data(), job->out.size());
+        }
+
+        lock_guard<mutex> hold(lock);
+        failed |= !out;
+        jobs.pop_front();
+        full.notify_all();
+    }
+}
+
+// flushes the last block and waits for everything to be written, false if
+// anything could not be compressed or written
+bool gzbuf::close(){
+
+    if (!current){
+        return !failed;
+    }
+
+    submit();
+    current.reset();
+    setp(nullptr, nullptr);
+
+    {
+        lock_guard<mutex> hold(lock);
+        done = true;
+        ready.notify_all();
+        finished.notify_all();
+    }
+
+    for (auto &t : pool){
+        t.join();
+    }
+    writer.join();
+    out.flush();
+    failed |= !out;
+
+    return !failed;
+}
+
+// only the write position is known: the uncompressed bytes so far
+streambuf::pos_type gzbuf::seekoff(off_type off, ios_base::seekdir dir,
+                                   ios_base::openmode){
+
+    if (off != 0 || dir != ios_base::cur){
+        return pos_type(off_type(-1));
+    }
+
+    return pos_type(total + (pptr() - pbase()));
+}
+
+#ifdef BIAS_BENCH
+}
+#endif
@@ -11,6 +11,11 @@
 *          this script was meant to strengthen our own understanding of our 
 *          neural system.
 *
+*          To compile, use the following command:
+*              g++ neuralnet.cpp -std=c++11 -o neuralnet
+*          Add -DBIAS_PROF for per phase timings and counters (see the
+*          INSTRUMENTATION section), written to stderr and trace.json.
+*
 *          Please let me know if you need any further information!
 *              James Schloss
 *
@@ -22,13 +27,34 @@
 #include <cstdlib>
 #include <cmath>
 
+#ifdef BIAS_PROF
+#include <chrono>
+#include <mutex>
+#include <fstream>
+#include <string>
+#include <new>
+#include <algorithm>
+#include <atomic>
+#endif
+
 /*----------------------------------------------------------------------------//
 * STRUCTURES / FUNCTIONS
 *-----------------------------------------------------------------------------*/
 
 using namespace std;
 
-const int n = 5, tw = 10;
+// grid size, can be set at compile time (-DBIAS_N=...) as bench.cpp does
+#ifndef BIAS_N
+#define BIAS_N 5
+#endif
+
+// bench.cpp links a copy per grid size, each in namespace net<BIAS_N>
+#ifdef BIAS_BENCH
+#include "bench.h"
+namespace BIAS_NAME(net, BIAS_N){
+#endif
+
+const int n = BIAS_N, tw = 10;
 
 // structure for synaptic crossbars
 struct grid{
@@ -47,10 +73,230 @@ grid hebbian(grid data, double timestep, double LR);
 grid neurosum(grid data, vector <double> thresh, double tau,
                        double timestep);
 
+/*----------------------------------------------------------------------------//
+* INSTRUMENTATION
+*-----------------------------------------------------------------------------*/
+
+// Built with -DBIAS_PROF, the phases of a step are timed and counted:
+//     PROF_PHASE(ph)        times the rest of the enclosing scope as phase ph
+//     PROF_COUNT(what, k)   adds k to a counter (spikes, synapses)
+//     PROF_STEP()           ends a step, prints a summary every
+//                           BIAS_PROF_EVERY steps
+//     PROF_DUMP(path)       final summary and a Chrome trace (chrome://tracing)
+// Each thread writes only its own counters, registered once under a lock,
+// so recording never waits. They are relaxed atomics, so the summary can
+// read them while other threads count. Allocations made by the profiler
+// itself (its counters, the event buffer, the output) are not counted.
+// Without BIAS_PROF the macros are empty.
+
+enum phase {STIMULUS, INTEGRATE, THRESHOLD, LEARN, RECORD, PHASES};
+
+#ifdef BIAS_PROF
+
+#ifndef BIAS_PROF_EVERY
+#define BIAS_PROF_EVERY 100
+#endif
+
+// events reserved per thread up front
+const size_t prof_reserve = 1 << 16;
+
+// one timed phase, in microseconds from the start of the run
+struct prof_event{
+    int ph;
+    double start, dur;
+};
+
+// events is only read by PROF_DUMP, once the other threads are done
+struct prof_counters{
+    int tid;
+    atomic<unsigned long long> ns[PHASES], calls[PHASES];
+    atomic<unsigned long long> spikes, synapses, allocs;
+    vector<prof_event> events;
+};
+
+const char *phase_name[PHASES] = {"stimulus", "integrate", "threshold",
+                                  "learn", "record"};
+
+// operator new counts here (a plain thread_local needs no construction)
+// unless prof_paused is set; the count moves to the thread's counters at
+// the end of every phase and step
+thread_local unsigned long long prof_allocs = 0;
+thread_local bool prof_paused = false;
+
+mutex prof_lock;
+vector<prof_counters *> prof_threads;
+chrono::steady_clock::time_point prof_origin = chrono::steady_clock::now();
+atomic<unsigned long long> prof_steps(0);
+
+// allocations in its scope are the profiler's own
+struct prof_pause{
+    bool was;
+
+    prof_pause() : was(prof_paused){
+        prof_paused = true;
+    }
+
+    ~prof_pause(){
+        prof_paused = was;
+    }
+};
+
+// counters of the calling thread, kept until the end of the program so
+// the summary can still read them after the thread is gone
+prof_counters &prof_local(){
+
+    thread_local prof_counters *local = nullptr;
+
+    if (!local){
+        prof_pause pause;
+        local = new prof_counters();
+        local->events.reserve(prof_reserve);
+        lock_guard<mutex> hold(prof_lock);
+        local->tid = prof_threads.size();
+        prof_threads.push_back(local);
+    }
+
+    return *local;
+}
+
+double prof_us(chrono::steady_clock::time_point t){
+    return chrono::duration<double, micro>(t - prof_origin).count();
+}
+
+struct prof_scope{
+    int ph;
+    chrono::steady_clock::time_point start;
+
+    prof_scope(int p) : ph(p), start(chrono::steady_clock::now()){}
+
+    ~prof_scope(){
+        auto end = chrono::steady_clock::now();
+        prof_counters &c = prof_local();
+        prof_event ev = {ph, prof_us(start), prof_us(end) - prof_us(start)};
+
+        c.ns[ph].fetch_add(chrono::duration_cast<chrono::nanoseconds>(
+                               end - start).count(), memory_order_relaxed);
+        c.calls[ph].fetch_add(1, memory_order_relaxed);
+        c.allocs.fetch_add(prof_allocs, memory_order_relaxed);
+        prof_allocs = 0;
+
+        prof_pause pause;
+        c.events.push_back(ev);
+    }
+};
+
+// totals over all threads, per step
+void prof_summary(ostream &out){
+
+    prof_pause pause;
+    unsigned long long ns[PHASES] = {}, spikes = 0, synapses = 0, allocs = 0;
+    unsigned long long total = prof_steps.load(memory_order_relaxed);
+    double steps = max(total, 1ULL);
+
+    lock_guard<mutex> hold(prof_lock);
+    for (auto *c : prof_threads){
+        for (int ph = 0; ph < PHASES; ph++){
+            ns[ph] += c->ns[ph].load(memory_order_relaxed);
+        }
+        spikes += c->spikes.load(memory_order_relaxed);
+        synapses += c->synapses.load(memory_order_relaxed);
+        allocs += c->allocs.load(memory_order_relaxed);
+    }
+
+    out << "prof: " << total << " steps, per step:";
+    for (int ph = 0; ph < PHASES; ph++){
+        out << ' ' << phase_name[ph] << ' ' << ns[ph] / steps / 1e3 << " us,";
+    }
+    out << ' ' << spikes / steps << " spikes, " << synapses / steps
+        << " synapse updates, " << allocs / steps << " allocations\n";
+}
+
+void prof_step(){
+
+    prof_counters &c = prof_local();
+    c.allocs.fetch_add(prof_allocs, memory_order_relaxed);
+    prof_allocs = 0;
+
+    if ((prof_steps.fetch_add(1, memory_order_relaxed) + 1) %
+        BIAS_PROF_EVERY == 0){
+        prof_summary(cerr);
+    }
+}
+
+void prof_dump(const string &path){
+
+    prof_summary(cerr);
+
+    prof_pause pause;
+    ofstream out(path);
+    bool first = true;
+
+    out << "{\"traceEvents\": [\n";
+    lock_guard<mutex> hold(prof_lock);
+    for (auto *c : prof_threads){
+        for (auto &ev : c->events){
+            out << (first ? "" : ",\n") << "{\"name\": \""
+                << phase_name[ev.ph] << "\", \"ph\": \"X\", \"pid\": 1, "
+                << "\"tid\": " << c->tid << ", \"ts\": " << ev.start
+                << ", \"dur\": " << ev.dur << "}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+}
+
+#define PROF_CAT(a, b) a##b
+#define PROF_NAME(line) PROF_CAT(prof_scope_, line)
+#define PROF_PHASE(ph) prof_scope PROF_NAME(__LINE__)(ph)
+#define PROF_COUNT(what, k) \
+    (prof_local().what.fetch_add((k), memory_order_relaxed))
+#define PROF_STEP() prof_step()
+#define PROF_DUMP(path) prof_dump(path)
+
+#else
+
+#define PROF_PHASE(ph)
+#define PROF_COUNT(what, k)
+#define PROF_STEP()
+#define PROF_DUMP(path)
+
+#endif
+
 /*----------------------------------------------------------------------------//
 * MAIN
 *-----------------------------------------------------------------------------*/
 
+// bench.cpp brings its own main and times these instead, see bench.h
+#ifdef BIAS_BENCH
+grid bench_data, bench_learned;
+vector<double> bench_thresh;
+const double bench_tau = 0.2, bench_timestep = 0.1;
+
+void bench_grid(double density){
+
+    bench_data = fill_grid();
+    for (auto &row : bench_data.prefire){
+        for (size_t i = 0; i < row.size(); i++){
+            row[i] = rand() < density * RAND_MAX;
+        }
+    }
+
+    bench_thresh.clear();
+    for (int i = 0; i < n; i++){
+        bench_thresh.push_back((rand() % 1000 * 0.001) * 10 * n);
+    }
+}
+
+void bench_neurosum(){
+
+    bench_data.postfire.clear();
+    bench_data = neurosum(bench_data, bench_thresh, bench_tau, bench_timestep);
+}
+
+void bench_hebbian(){
+    bench_learned = hebbian(bench_data, bench_timestep, 0.001);
+}
+#else
 int main(void){
 
     srand(time(NULL));
@@ -68,7 +314,7 @@ int main(void){
         cout << endl << endl;
 
         for (int k = 0; k < tw; k++){
-            cout << data.prefire[i][k];
+            cout << data.prefire[k][i];
         }
         cout << endl;
 
@@ -90,6 +336,8 @@ int main(void){
 
     data = hebbian(data, timestep, 0.001);
 
+    PROF_STEP();
+
     for (int i = 0; i < n; i++){
         for (int j = 0; j < n; j++){
             cout << data.weight[i][j] << '\t';
@@ -97,15 +345,47 @@ int main(void){
         cout << endl << endl;
     }
 
+    PROF_DUMP("trace.json");
+
     return 0;
 }
 
+// allocations are counted for the instrumentation; not in bench.cpp, where
+// this file sits in a namespace. noinline keeps GCC from pairing an inlined
+// malloc with the delete of a new it cannot see (-Wmismatched-new-delete);
+// the sized delete (used from C++14 on) is replaced too, so every delete
+// goes through free.
+#ifdef BIAS_PROF
+__attribute__((noinline)) void *operator new(size_t size){
+
+    if (!prof_paused){
+        prof_allocs++;
+    }
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr){
+        throw bad_alloc();
+    }
+
+    return ptr;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept{
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept{
+    free(ptr);
+}
+#endif
+#endif
+
 /*----------------------------------------------------------------------------//
 * SUBROUTINES
 *-----------------------------------------------------------------------------*/
 
 // function for filling our synaptic crossbar
 grid fill_grid(){
+    PROF_PHASE(STIMULUS);
     grid data;
     vector<bool> rn(n,false);
 
@@ -134,33 +414,41 @@ grid hebbian(grid data, double timestep, double LR){
 
     double history[n][n] = {}, delta = 0.001;
     vector <bool> rn(n,false);
-    cout << "check " <<  data.postfire[0].size() << endl;
 
     // Updating the weights positively by checking the last postsynaptic firing
     // and adding it to our history from the presynaptc firings
-    for (int i = 0; i < n; i++){
-        cout << i << endl;
-        for (int j = 0; j < n; j++){
-
-            if (data.postfire[data.postfire.size() - 1][i] == 1){
-                for (int k = 0; k < tw; k++){
-                    if (data.prefire[i][k] == 1){
-                        history[i][j] += 1 / ((k + delta) * timestep); 
-                        cout << history[i][j] << endl;
+    {
+        PROF_PHASE(LEARN);
+        for (int i = 0; i < n; i++){
+            for (int j = 0; j < n; j++){
+
+                if (data.postfire[data.postfire.size() - 1][i] == 1){
+                    for (int k = 0; k < tw; k++){
+                        if (data.prefire[k][i] == 1){
+                            history[i][j] += 1 / ((k + delta) * timestep); 
+                        }
                     }
                 }
-            }
 
+            }
         }
-        rn[i] = round(rand() % 10 / 10.0);
-        cout << rn[i] << endl;
+    }
 
+    // new presynaptic firings for the next time window
+    {
+        PROF_PHASE(STIMULUS);
+        for (int i = 0; i < n; i++){
+            rn[i] = round(rand() % 10 / 10.0);
+        }
     }
 
-    data.prefire.erase(data.prefire.begin());
-    data.prefire.push_back(rn);
+    {
+        PROF_PHASE(RECORD);
+        data.prefire.erase(data.prefire.begin());
+        data.prefire.push_back(rn);
+    }
 
-    cout << endl << endl;
+    PROF_PHASE(LEARN);
 
     // Updating the weights negatively through a similar mechanism as above
     for (int i = 0; i < n; i++){
@@ -168,8 +456,6 @@ grid hebbian(grid data, double timestep, double LR){
             if (data.prefire[data.prefire.size() - 1][i] == 1){
                 for (int k = 0; k < tw; k++){
                     history[i][j] += -1 / ((k + delta) * timestep); 
-                   cout << history[i][j] << endl;
-
                 }
             }
 
@@ -182,6 +468,8 @@ grid hebbian(grid data, double timestep, double LR){
         }
     }
 
+    PROF_COUNT(synapses, n * n);
+
     return data;
 }
 
@@ -193,35 +481,47 @@ grid neurosum(grid data, vector <double> thresh, double tau,
     vector<double> cumulative(n, false);
     double pt_cumulative = 0, t;
 
-    for (int i = 0; i < n; i++){
+    {
+        PROF_PHASE(INTEGRATE);
+        for (int i = 0; i < n; i++){
 
-        cumulative[i] = 0;
+            cumulative[i] = 0;
 
-        for (int j = 0; j < n; j++){
+            for (int j = 0; j < n; j++){
 
-            pt_cumulative = 0;
+                pt_cumulative = 0;
 
-            for (unsigned int k = 0; k < data.prefire.size(); k++){
-                t = k * timestep;
-                pt_cumulative += data.prefire[i][k] * exp(-(t * tau));
-            }
+                for (unsigned int k = 0; k < data.prefire.size(); k++){
+                    t = k * timestep;
+                    pt_cumulative += data.prefire[k][i] * exp(-(t * tau));
+                }
 
-            cumulative[i] += pt_cumulative;
+                cumulative[i] += pt_cumulative;
 
+            }
         }
     }
 
-    for (int i = 0; i < n; i++){
-        if (cumulative[i] > thresh[i]) {
-            sum[i] = 1;
-        }
-        else{
-            sum[i] = 0;
-        }
+    {
+        PROF_PHASE(THRESHOLD);
+        for (int i = 0; i < n; i++){
+            if (cumulative[i] > thresh[i]) {
+                sum[i] = 1;
+                PROF_COUNT(spikes, 1);
+            }
+            else{
+                sum[i] = 0;
+            }
 
+        }
     }
 
+    PROF_PHASE(RECORD);
     data.postfire.push_back(sum);
 
     return data;
 }
+
+#ifdef BIAS_BENCH
+}
+#endif
@@ -0,0 +1,429 @@
+/*-------------rawspike.cpp---------------------------------------------------//
+*
+*              rawspike -- spike trains from ngspice raw files
+*
+* Purpose: After a core from netlist_gen.cpp is simulated, the waveforms at
+*          its axon and hillock nodes have to be turned back into spikes to
+*          be compared with the postfire raster of neuralnet.cpp.
+*
+*   Notes: The raw file is memory mapped and only the header is parsed as
+*          text; of the data, only the requested vectors are read. Both the
+*          binary (Binary:) and the ASCII (Values:) layout are read, real
+*          data only, from the first transient plot in the file.
+*
+*          To compile, use the following command:
+*              g++ rawspike.cpp -std=c++11 -O2 -o rawspike
+*
+*          Run as ./rawspike [options] <file.raw> <node>...
+*              -t <V>    spike threshold (default: halfway between the
+*                        lowest and highest voltage of each node)
+*              -w <s>    width of a time bin (default: 10 bins over the run,
+*                        the time window of neuralnet.cpp)
+*          Nodes are given by name as in the netlist (25, or v(25)).
+*
+*          A spike is a rising crossing of the threshold. The raster goes
+*          to stdout like prefire / postfire in neuralnet.cpp: one line per
+*          time bin k, one 0 / 1 per node i, so line k column i is
+*          postfire[k][i]. Spike counts per node go to stderr.
+*
+*-----------------------------------------------------------------------------*/
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cctype>
+#include <chrono>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*----------------------------------------------------------------------------//
+* STRUCTURES AND FUNCTIONS
+*-----------------------------------------------------------------------------*/
+
+using namespace std;
+
+// one plot of a raw file: its variables and where its data starts
+// data is the first byte after "Binary:\n" / "Values:\n", end the end of
+// the file
+struct plot{
+    string name;
+    bool binary, real;
+    long vars, points;
+    vector<string> var;
+    const char *data, *end;
+};
+
+// bins of the raster, the time window of neuralnet.cpp
+const int tw = 10;
+
+// Reads the header of the plot starting at pos, false if there is none
+bool read_header(const char *pos, const char *end, plot &pl);
+
+// Finds the end of the data of a plot
+const char *plot_end(const plot &pl);
+
+// Finds the next whitespace separated token in [pos, end), false if there
+// is none; pos is left after it
+bool token(const char *&pos, const char *end, const char *&first);
+
+// Column of a node in the plot, -1 if it is not there
+int find_var(const plot &pl, const string &node);
+
+// Gathers the time vector and the given columns, one vector per column;
+// false if the data ends before the last point
+bool gather(const plot &pl, const vector<int> &cols, vector<double> &time,
+            vector<vector<double>> &wave);
+
+// Rising crossings of thresh in a waveform, as sample indices
+void crossings(const vector<double> &v, double thresh, vector<long> &at);
+
+/*----------------------------------------------------------------------------//
+* MAIN
+*-----------------------------------------------------------------------------*/
+
+int main(int argc, char **argv){
+
+    double thresh = NAN, width = 0;
+    vector<string> nodes;
+    string path;
+
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc){
+            thresh = atof(argv[++i]);
+        }
+        else if (arg == "-w" && i + 1 < argc){
+            width = atof(argv[++i]);
+        }
+        else if (path.empty()){
+            path = arg;
+        }
+        else{
+            nodes.push_back(arg);
+        }
+    }
+
+    if (path.empty() || nodes.empty()){
+        cerr << "usage: rawspike [-t V] [-w s] <file.raw> <node>...\n";
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0){
+        cerr << "could not open " << path << '\n';
+        return 1;
+    }
+
+    size_t size = st.st_size;
+    const char *raw = (const char *)mmap(nullptr, size, PROT_READ,
+                                         MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (raw == MAP_FAILED){
+        cerr << "could not map " << path << '\n';
+        return 1;
+    }
+    madvise((void *)raw, size, MADV_SEQUENTIAL);
+
+    // operating points and the like come before the transient plot
+    plot pl;
+    const char *pos = raw, *end = raw + size;
+    bool found = false;
+    // only skipped plots are scanned for their end, the transient data is
+    // read once, by gather
+    while (read_header(pos, end, pl)){
+        if (pl.name.find("ransient") != string::npos){
+            found = true;
+            break;
+        }
+        pos = plot_end(pl);
+        if (!pos){
+            break;
+        }
+    }
+
+    if (!found || !pl.real || pl.vars < 1 || pl.var[0] != "time"){
+        cerr << "no real transient plot in " << path << '\n';
+        munmap((void *)raw, size);
+        return 1;
+    }
+
+    vector<int> cols;
+    for (auto &node : nodes){
+        int c = find_var(pl, node);
+        if (c < 0){
+            cerr << "no node " << node << " in " << path << '\n';
+            munmap((void *)raw, size);
+            return 1;
+        }
+        cols.push_back(c);
+    }
+
+    vector<double> time;
+    vector<vector<double>> wave;
+    bool complete = gather(pl, cols, time, wave);
+    munmap((void *)raw, size);
+
+    if (!complete){
+        cerr << path << " ends before its last point\n";
+        return 1;
+    }
+
+    if (time.empty()){
+        cerr << "no points in " << path << '\n';
+        return 1;
+    }
+
+    double t0 = time.front(), t1 = time.back();
+    if (width <= 0){
+        width = (t1 - t0) / tw;
+    }
+    long bins = width > 0 ? max(1L, (long)ceil((t1 - t0) / width)) : 1;
+
+    // the raster as neuralnet.cpp keeps it, raster[k][i]
+    vector<vector<bool>> raster(bins, vector<bool>(nodes.size(), false));
+    vector<long> at;
+
+    for (size_t i = 0; i < nodes.size(); i++){
+        double th = thresh;
+        if (std::isnan(th)){
+            auto lim = minmax_element(wave[i].begin(), wave[i].end());
+            th = (*lim.first + *lim.second) / 2;
+        }
+
+        crossings(wave[i], th, at);
+        for (long s : at){
+            long k = width > 0 ? (long)((time[s] - t0) / width) : 0;
+            raster[min(k, bins - 1)][i] = 1;
+        }
+
+        cerr << nodes[i] << ": " << at.size() << " spikes (threshold " << th
+             << " V)\n";
+    }
+
+    for (auto &row : raster){
+        for (bool b : row){
+            cout << b;
+        }
+        cout << '\n';
+    }
+
+    double ms = chrono::duration<double, milli>(
+                    chrono::steady_clock::now() - start).count();
+    cerr << "rawspike: " << time.size() << " points, " << pl.vars
+         << " vectors, " << bins << " bins (" << ms << " ms)\n";
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------//
+* SUBROUTINES
+*-----------------------------------------------------------------------------*/
+
+// The header is "Key: value" lines up to "Variables:", then one line per
+// variable (index, name, type), then "Binary:" or "Values:"
+bool read_header(const char *pos, const char *end, plot &pl){
+
+    pl = plot();
+    pl.real = true;
+    pl.vars = pl.points = -1;
+    bool vars = false;
+
+    while (pos < end){
+        const char *eol = (const char *)memchr(pos, '\n', end - pos);
+        if (!eol){
+            eol = end;
+        }
+        string line(pos, eol);
+        pos = eol + (eol < end);
+
+        if (!line.empty() && line.back() == '\r'){
+            line.pop_back();
+        }
+        if (line.empty()){
+            continue;
+        }
+
+        if (vars && (line[0] == ' ' || line[0] == '\t')){
+            char name[256];
+            long idx;
+            if (sscanf(line.c_str(), "%ld %255s", &idx, name) == 2){
+                pl.var.push_back(name);
+            }
+            continue;
+        }
+        vars = false;
+
+        size_t colon = line.find(':');
+        string key = line.substr(0, colon);
+        string value = colon == string::npos ? "" : line.substr(colon + 1);
+
+        if (key == "Plotname"){
+            pl.name = value;
+        }
+        else if (key == "Flags"){
+            pl.real = value.find("complex") == string::npos;
+        }
+        else if (key == "No. Variables"){
+            pl.vars = atol(value.c_str());
+        }
+        else if (key == "No. Points"){
+            pl.points = atol(value.c_str());
+        }
+        else if (key == "Variables"){
+            vars = true;
+        }
+        else if (key == "Binary" || key == "Values"){
+            pl.binary = key == "Binary";
+            pl.data = pos;
+            pl.end = end;
+            return pl.vars > 0 && pl.points >= 0 &&
+                   (long)pl.var.size() == pl.vars;
+        }
+    }
+
+    return false;
+}
+
+// Binary data is points * vars doubles, time first in every point. ASCII
+// data is "<point> <value>" and then one value per line for the other
+// variables, so a plot ends after points * (vars + 1) numbers.
+const char *plot_end(const plot &pl){
+
+    if (pl.binary){
+        unsigned long long bytes = (unsigned long long)pl.points * pl.vars *
+                                   sizeof(double);
+        if (bytes > (unsigned long long)(pl.end - pl.data)){
+            return nullptr;
+        }
+        return pl.data + bytes;
+    }
+
+    const char *pos = pl.data, *first;
+    unsigned long long tokens = (unsigned long long)pl.points * (pl.vars + 1);
+    for (unsigned long long t = 0; t < tokens; t++){
+        if (!token(pos, pl.end, first)){
+            return nullptr;
+        }
+    }
+
+    return pos;
+}
+
+bool token(const char *&pos, const char *end, const char *&first){
+
+    while (pos < end && isspace((unsigned char)*pos)){
+        pos++;
+    }
+    first = pos;
+    while (pos < end && !isspace((unsigned char)*pos)){
+        pos++;
+    }
+
+    return pos > first;
+}
+
+int find_var(const plot &pl, const string &node){
+
+    string wrapped = "v(" + node + ")";
+    for (long c = 1; c < pl.vars; c++){
+        if (pl.var[c] == node || pl.var[c] == wrapped){
+            return c;
+        }
+    }
+
+    return -1;
+}
+
+// Binary points are read with memcpy, as the data after the text header
+// need not be aligned. In ASCII data the values of other vectors are only
+// skipped, not converted. The mapping has no terminating NUL, so a value
+// is copied out before strtod reads it.
+bool gather(const plot &pl, const vector<int> &cols, vector<double> &time,
+            vector<vector<double>> &wave){
+
+    long np = pl.points, nv = pl.vars;
+    time.resize(np);
+    wave.assign(cols.size(), vector<double>(np));
+
+    // the column each variable goes to, -1 for skipped ones
+    vector<int> slot(nv, -1);
+    for (size_t i = 0; i < cols.size(); i++){
+        slot[cols[i]] = i;
+    }
+
+    if (pl.binary){
+        size_t stride = nv * sizeof(double);
+        if ((unsigned long long)np * stride > (size_t)(pl.end - pl.data)){
+            return false;
+        }
+        for (long s = 0; s < np; s++){
+            const char *point = pl.data + s * stride;
+            memcpy(&time[s], point, sizeof(double));
+            for (size_t i = 0; i < cols.size(); i++){
+                memcpy(&wave[i][s], point + cols[i] * sizeof(double),
+                       sizeof(double));
+            }
+        }
+        return true;
+    }
+
+    const char *pos = pl.data, *first;
+    char text[64];
+    auto value = [&](){
+        size_t len = min<size_t>(pos - first, sizeof(text) - 1);
+        memcpy(text, first, len);
+        text[len] = 0;
+        return strtod(text, nullptr);
+    };
+
+    for (long s = 0; s < np; s++){
+        // point number
+        if (!token(pos, pl.end, first)){
+            return false;
+        }
+        for (long v = 0; v < nv; v++){
+            if (!token(pos, pl.end, first)){
+                return false;
+            }
+            if (v == 0){
+                time[s] = value();
+            }
+            else if (slot[v] >= 0){
+                wave[slot[v]][s] = value();
+            }
+        }
+    }
+
+    return true;
+}
+
+// The compare runs without branches over the whole waveform, so it is
+// vectorized; crossings are rare, so collecting them afterwards is cheap.
+void crossings(const vector<double> &v, double thresh, vector<long> &at){
+
+    long np = v.size();
+    vector<unsigned char> up(np, 0);
+    const double *x = v.data();
+    unsigned char *u = up.data();
+
+    for (long s = 1; s < np; s++){
+        u[s] = (x[s - 1] < thresh) & (x[s] >= thresh);
+    }
+
+    at.clear();
+    for (long s = 1; s < np; s++){
+        if (u[s]){
+            at.push_back(s);
+        }
+    }
+}